@@ -0,0 +1,302 @@
+#include <ApiSet.hpp>
+
+#include <DllName.hpp>
+#include <File.hpp>
+#include <PE.hpp>
+#include <cstring>
+
+// https://www.geoffchappell.com/studies/windows/win32/apisetschema/index.htm
+// Offsets are relative to the start of the schema, and lengths are in bytes of
+// UTF-16 text.
+struct ApiSetNamespace
+{
+    uint32_t version;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t count;
+    uint32_t entry_offset;
+    uint32_t hash_offset;
+    uint32_t hash_factor;
+};
+
+struct ApiSetNamespaceEntry
+{
+    uint32_t flags;
+    uint32_t name_offset;
+    uint32_t name_length;
+    // Length of the name up to its last hyphen, which is all the loader
+    // compares.
+    uint32_t hashed_length;
+    uint32_t value_offset;
+    uint32_t value_count;
+};
+
+struct ApiSetValueEntry
+{
+    uint32_t flags;
+    // Importer this value applies to, or empty for the default host
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+};
+
+constexpr static uint32_t schema_version = 6;
+constexpr static char const* schema_section_name = ".apiset";
+
+static bool same_name(char const* a, char const* b, size_t length)
+{
+    return same_dll(std::string_view{a, length}, std::string_view{b, length});
+}
+
+bool ApiSet::load(std::string const& path, std::string& error)
+{
+    File file;
+    if (!file.load(path, false))
+    {
+        error = "failed to open " + path;
+        return false;
+    }
+
+    char const* data = file.fetch(0, 2);
+    uint32_t size    = (uint32_t)file.size();
+
+    if (data && memcmp(data, "MZ", 2) == 0)
+    {
+        PE pe;
+        Status status = pe.load(file);
+        if (status == Status::Ok)
+        {
+            status = pe.section_data(schema_section_name, data, size);
+        }
+
+        if (status == Status::InvalidImage)
+        {
+            error = path + " has no " + schema_section_name + " section";
+            return false;
+        }
+        else if (status != Status::Ok)
+        {
+            error = describe(status);
+            return false;
+        }
+    }
+    else
+    {
+        data = file.fetch(0, size);
+    }
+
+    if (!data)
+    {
+        error = "failed to read " + path;
+        return false;
+    }
+    return parse(data, size, error);
+}
+
+bool ApiSet::parse(char const* data, size_t size, std::string& error)
+{
+    pool_.clear();
+    contracts_.clear();
+    exceptions_.clear();
+    slots_.clear();
+
+    auto in_bounds = [&](uint64_t offset, uint64_t length) {
+        return offset + length <= size;
+    };
+
+    // Appends UTF-16 text to the pool as lower-cased ASCII, which is all that
+    // DLL names in the schema use.
+    auto intern = [&](uint32_t offset, uint32_t length, uint32_t& at) {
+        if (length % 2 != 0 || !in_bounds(offset, length))
+        {
+            return false;
+        }
+
+        at = (uint32_t)pool_.size();
+        for (uint32_t i = 0; i != length; i += 2)
+        {
+            uint16_t unit;
+            memcpy(&unit, data + offset + i, sizeof(unit));
+            if (unit == 0 || unit > 0x7f)
+            {
+                return false;
+            }
+            pool_.push_back(ascii_lower((char)unit));
+        }
+        pool_.push_back('\0');
+        return true;
+    };
+
+    ApiSetNamespace schema;
+    if (!in_bounds(0, sizeof(schema)))
+    {
+        error = "schema is truncated";
+        return false;
+    }
+    memcpy(&schema, data, sizeof(schema));
+
+    if (schema.version != schema_version)
+    {
+        error = "unsupported schema version " + std::to_string(schema.version)
+                + " (only version 6, from Windows 10 onwards, is supported)";
+        return false;
+    }
+
+    if (!in_bounds(schema.entry_offset,
+                   (uint64_t)schema.count * sizeof(ApiSetNamespaceEntry)))
+    {
+        error = "schema is truncated";
+        return false;
+    }
+
+    contracts_.reserve(schema.count);
+    for (uint32_t i = 0; i != schema.count; ++i)
+    {
+        ApiSetNamespaceEntry entry;
+        memcpy(&entry,
+               data + schema.entry_offset + i * sizeof(entry),
+               sizeof(entry));
+
+        if (!in_bounds(entry.value_offset,
+                       (uint64_t)entry.value_count * sizeof(ApiSetValueEntry)))
+        {
+            error = "schema is truncated";
+            return false;
+        }
+
+        // Contracts without a host (such as extensions which aren't
+        // installed) fail to load, so are left unresolved.
+        ApiSetValueEntry value;
+        if (entry.value_count == 0)
+        {
+            continue;
+        }
+        memcpy(&value, data + entry.value_offset, sizeof(value));
+        if (value.value_length == 0)
+        {
+            continue;
+        }
+
+        Contract contract = {};
+        if (!intern(entry.name_offset, entry.hashed_length, contract.name)
+            || !intern(value.value_offset, value.value_length, contract.host))
+        {
+            error = "schema contract " + std::to_string(i) + " is malformed";
+            return false;
+        }
+        contract.name_length     = entry.hashed_length / 2;
+        contract.hash            = hash_dll(
+            {pool_.data() + contract.name, contract.name_length});
+        contract.first_exception = (uint32_t)exceptions_.size();
+
+        // Any further values redirect particular importers elsewhere
+        for (uint32_t k = 1; k != entry.value_count; ++k)
+        {
+            memcpy(&value,
+                   data + entry.value_offset + k * sizeof(value),
+                   sizeof(value));
+
+            Exception exception = {};
+            if (!intern(value.name_offset,
+                        value.name_length,
+                        exception.importer)
+                || !intern(value.value_offset,
+                           value.value_length,
+                           exception.host))
+            {
+                error = "schema contract " + std::to_string(i)
+                        + " is malformed";
+                return false;
+            }
+            exceptions_.push_back(exception);
+        }
+        contract.exception_count = (uint32_t)exceptions_.size()
+                                   - contract.first_exception;
+
+        contracts_.push_back(contract);
+    }
+
+    size_t capacity = 16;
+    while (capacity < contracts_.size() * 2)
+    {
+        capacity *= 2;
+    }
+    slots_.assign(capacity, 0);
+
+    for (uint32_t i = 0; i != contracts_.size(); ++i)
+    {
+        size_t slot = contracts_[i].hash & (capacity - 1);
+        while (slots_[slot] != 0)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots_[slot] = i + 1;
+    }
+
+    return true;
+}
+
+char const* ApiSet::resolve(char const* name, char const* importer) const
+{
+    if (slots_.empty())
+    {
+        return nullptr;
+    }
+
+    size_t length = strlen(name);
+    if (length >= 4 && same_name(name + length - 4, ".dll", 4))
+    {
+        length -= 4;
+    }
+
+    // Only names with these prefixes are redirected
+    if (length < 4
+        || (!same_name(name, "api-", 4) && !same_name(name, "ext-", 4)))
+    {
+        return nullptr;
+    }
+
+    size_t prefix = length;
+    while (prefix != 0 && name[prefix - 1] != '-')
+    {
+        --prefix;
+    }
+    if (prefix == 0)
+    {
+        return nullptr;
+    }
+    --prefix;
+
+    uint32_t hash = hash_dll({name, prefix});
+    size_t mask   = slots_.size() - 1;
+    for (size_t slot = hash & mask; slots_[slot] != 0; slot = (slot + 1) & mask)
+    {
+        Contract const& contract = contracts_[slots_[slot] - 1];
+        if (contract.hash != hash || contract.name_length != prefix
+            || !same_name(name, pool_.data() + contract.name, prefix))
+        {
+            continue;
+        }
+
+        if (importer)
+        {
+            size_t importer_length = strlen(importer);
+            for (uint32_t k = 0; k != contract.exception_count; ++k)
+            {
+                Exception const& exception
+                    = exceptions_[contract.first_exception + k];
+                char const* candidate = pool_.data() + exception.importer;
+                if (strlen(candidate) == importer_length
+                    && same_name(candidate, importer, importer_length))
+                {
+                    return pool_.data() + exception.host;
+                }
+            }
+        }
+
+        return pool_.data() + contract.host;
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An API Set schema, mapping contract names such as
+// api-ms-win-crt-heap-l1-1-0.dll to the host DLLs the loader redirects them
+// to. Contracts are kept in an open-addressed hash table keyed by the name
+// prefix the loader matches on, so that resolving an import neither allocates
+// nor scans the schema.
+// https://learn.microsoft.com/en-us/windows/win32/apiindex/windows-apisets
+class ApiSet
+{
+public:
+    // Reads the schema from the .apiset section of apisetschema.dll, or from a
+    // raw copy of that section.
+    bool load(std::string const& path, std::string& error);
+
+    // Parses a version 6 schema, as used by Windows 10 and later
+    bool parse(char const* data, size_t size, std::string& error);
+
+    uint32_t contract_count() const
+    {
+        return (uint32_t)contracts_.size();
+    }
+
+    // Returns the host DLL a contract resolves to, or nullptr if `name` isn't
+    // a contract in the schema or has no host. The version following the last
+    // hyphen and any .dll extension are ignored, as they are by the loader. A
+    // few contracts resolve differently for particular importers, which
+    // `importer` selects if given.
+    char const* resolve(char const* name, char const* importer = nullptr) const;
+
+private:
+    struct Contract
+    {
+        uint32_t hash;
+        // Lower-cased name up to its last hyphen, in the pool
+        uint32_t name;
+        uint32_t name_length;
+        uint32_t host;
+        uint32_t first_exception;
+        uint32_t exception_count;
+    };
+
+    struct Exception
+    {
+        uint32_t importer;
+        uint32_t host;
+    };
+
+    // Null-terminated names, referenced by offset
+    std::string pool_;
+
+    std::vector<Contract> contracts_;
+    std::vector<Exception> exceptions_;
+
+    // Index + 1 of the contract in each slot, or 0 if the slot is empty. The
+    // size is a power of two, at most half full.
+    std::vector<uint32_t> slots_;
+};
@@ -0,0 +1,240 @@
+#include <Diff.hpp>
+
+#include <DllName.hpp>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+// Index of the first import of each DLL
+using DllIndex
+    = std::unordered_map<std::string_view, uint32_t, DllHash, DllEqual>;
+
+// Symbols of later imports of a DLL are moved to its first, so each DLL is
+// diffed across all of its entries
+static DllIndex index_dlls(std::vector<ImportedModule>& modules)
+{
+    DllIndex index;
+    index.reserve(modules.size());
+    for (uint32_t i = 0; i != modules.size(); ++i)
+    {
+        auto [it, inserted] = index.emplace(modules[i].name, i);
+        if (!inserted)
+        {
+            std::vector<ImportedSymbol>& first = modules[it->second].symbols;
+            std::vector<ImportedSymbol>& later = modules[i].symbols;
+            first.insert(first.end(), later.begin(), later.end());
+            later.clear();
+        }
+    }
+    return index;
+}
+
+// Symbols by name, along with those which only have an ordinal
+struct SymbolSet
+{
+    std::unordered_set<std::string_view> names;
+    std::unordered_set<uint16_t> ordinals;
+
+    template <typename Symbol>
+    explicit SymbolSet(std::vector<Symbol> const& symbols)
+    {
+        names.reserve(symbols.size());
+        for (Symbol const& symbol : symbols)
+        {
+            if (symbol.name)
+            {
+                names.insert(symbol.name);
+            }
+            else
+            {
+                ordinals.insert(symbol.ordinal);
+            }
+        }
+    }
+
+    template <typename Symbol>
+    bool contains(Symbol const& symbol) const
+    {
+        return symbol.name ? names.count(symbol.name) != 0
+                           : ordinals.count(symbol.ordinal) != 0;
+    }
+};
+
+template <typename Symbol>
+static void diff_symbols(std::vector<Symbol> const& before,
+                         std::vector<Symbol> const& after,
+                         std::vector<Symbol>& added,
+                         std::vector<Symbol>& removed)
+{
+    SymbolSet old_set{before};
+    SymbolSet new_set{after};
+
+    for (Symbol const& symbol : after)
+    {
+        if (!old_set.contains(symbol))
+        {
+            added.push_back(symbol);
+        }
+    }
+
+    for (Symbol const& symbol : before)
+    {
+        if (!new_set.contains(symbol))
+        {
+            removed.push_back(symbol);
+        }
+    }
+}
+
+uint32_t ImageDiff::changes() const
+{
+    uint32_t mask = 0;
+    auto add      = [&mask](bool present, Change change) {
+        if (present)
+        {
+            mask |= (uint32_t)change;
+        }
+    };
+
+    add(!added_dlls.empty(), Change::AddedDll);
+    add(!removed_dlls.empty(), Change::RemovedDll);
+    add(!moved_dlls.empty(), Change::Order);
+    for (SymbolChanges const& dll : symbols)
+    {
+        add(!dll.added.empty(), Change::AddedSymbol);
+        add(!dll.removed.empty(), Change::RemovedSymbol);
+    }
+    add(!added_exports.empty(), Change::AddedExport);
+    add(!removed_exports.empty(), Change::RemovedExport);
+
+    return mask;
+}
+
+Status diff_images(PE& before, PE& after, ImageDiff& diff)
+{
+    diff = {};
+
+    std::vector<ImportedModule> old_modules;
+    std::vector<ImportedModule> new_modules;
+    Status status = before.read_imports(old_modules);
+    if (status == Status::Ok)
+    {
+        status = after.read_imports(new_modules);
+    }
+    if (status != Status::Ok)
+    {
+        return status;
+    }
+
+    DllIndex old_index = index_dlls(old_modules);
+    DllIndex new_index = index_dlls(new_modules);
+
+    // Old index of each DLL imported by both, in new load order
+    std::vector<uint32_t> positions;
+    std::vector<uint32_t> new_positions;
+
+    for (uint32_t i = 0; i != new_modules.size(); ++i)
+    {
+        ImportedModule const& module = new_modules[i];
+
+        // Later imports of the same DLL have no effect on the load order
+        if (new_index[module.name] != i)
+        {
+            continue;
+        }
+
+        auto it = old_index.find(module.name);
+        if (it == old_index.end())
+        {
+            diff.added_dlls.push_back(module.name);
+            continue;
+        }
+
+        positions.push_back(it->second);
+        new_positions.push_back(i);
+
+        SymbolChanges changes{};
+        changes.dll = module.name;
+        diff_symbols(old_modules[it->second].symbols,
+                     module.symbols,
+                     changes.added,
+                     changes.removed);
+        if (!changes.added.empty() || !changes.removed.empty())
+        {
+            diff.symbols.push_back(std::move(changes));
+        }
+    }
+
+    for (uint32_t i = 0; i != old_modules.size(); ++i)
+    {
+        char const* name = old_modules[i].name;
+        if (old_index[name] == i && new_index.count(name) == 0)
+        {
+            diff.removed_dlls.push_back(name);
+        }
+    }
+
+    // DLLs on a longest increasing run of old positions kept their relative
+    // order, so only the rest moved. Found by patience sorting: `tails` holds
+    // the index ending the best run of each length so far.
+    std::vector<uint32_t> tails;
+    std::vector<uint32_t> previous(positions.size(), UINT32_MAX);
+    for (uint32_t i = 0; i != positions.size(); ++i)
+    {
+        auto it = std::lower_bound(tails.begin(),
+                                   tails.end(),
+                                   positions[i],
+                                   [&](uint32_t tail, uint32_t position) {
+                                       return positions[tail] < position;
+                                   });
+        if (it != tails.begin())
+        {
+            previous[i] = *(it - 1);
+        }
+
+        if (it == tails.end())
+        {
+            tails.push_back(i);
+        }
+        else
+        {
+            *it = i;
+        }
+    }
+
+    std::vector<bool> kept(positions.size());
+    for (uint32_t i = tails.empty() ? UINT32_MAX : tails.back();
+         i != UINT32_MAX;
+         i = previous[i])
+    {
+        kept[i] = true;
+    }
+
+    for (uint32_t i = 0; i != positions.size(); ++i)
+    {
+        if (!kept[i])
+        {
+            diff.moved_dlls.push_back({new_modules[new_positions[i]].name,
+                                       positions[i],
+                                       new_positions[i]});
+        }
+    }
+
+    std::vector<ExportedSymbol> old_exports;
+    std::vector<ExportedSymbol> new_exports;
+    status = before.read_exports(old_exports);
+    if (status == Status::Ok)
+    {
+        status = after.read_exports(new_exports);
+    }
+    if (status != Status::Ok)
+    {
+        return status;
+    }
+
+    diff_symbols(
+        old_exports, new_exports, diff.added_exports, diff.removed_exports);
+
+    return Status::Ok;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <PE.hpp>
+#include <cstdint>
+#include <vector>
+
+// Classes of change between two images, combined as a mask
+enum class Change : uint32_t
+{
+    AddedDll      = 0x1,
+    RemovedDll    = 0x2,
+    Order         = 0x4,
+    AddedSymbol   = 0x8,
+    RemovedSymbol = 0x10,
+    AddedExport   = 0x20,
+    RemovedExport = 0x40,
+    // Only found when comparing directories, never by diff_images
+    AddedImage   = 0x80,
+    RemovedImage = 0x100,
+};
+
+// A DLL imported by both images, whose position relative to the others
+// changed
+struct MovedImport
+{
+    // As named by the new image
+    char const* name;
+    uint32_t old_index;
+    uint32_t new_index;
+};
+
+// Symbols added to or removed from a DLL imported by both images
+struct SymbolChanges
+{
+    char const* dll;
+    std::vector<ImportedSymbol> added;
+    std::vector<ImportedSymbol> removed;
+};
+
+// Differences between the import and export surfaces of two images. Names
+// point into the images, so both PEs must outlive the diff.
+struct ImageDiff
+{
+    // In the load order of the image importing them
+    std::vector<char const*> added_dlls;
+    std::vector<char const*> removed_dlls;
+
+    // The fewest imports which, once moved, turn the old load order into the
+    // new one, in new load order
+    std::vector<MovedImport> moved_dlls;
+
+    // In new load order
+    std::vector<SymbolChanges> symbols;
+
+    std::vector<ExportedSymbol> added_exports;
+    std::vector<ExportedSymbol> removed_exports;
+
+    // Mask of the Change classes present
+    uint32_t changes() const;
+};
+
+// Compares the imports and exports of two images. DLLs match
+// case-insensitively, with the symbols of all their import entries combined,
+// and symbols by name, or by ordinal when they have none.
+// Each side is indexed in a hash table once, so the cost is linear in the
+// number of imports and exports rather than quadratic.
+Status diff_images(PE& before, PE& after, ImageDiff& diff);
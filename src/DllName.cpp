@@ -0,0 +1,36 @@
+#include <DllName.hpp>
+
+bool same_dll(char const* a, char const* b)
+{
+    for (; *a && ascii_lower(*a) == ascii_lower(*b); ++a, ++b)
+    {
+    }
+    return ascii_lower(*a) == ascii_lower(*b);
+}
+
+bool same_dll(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i != a.size(); ++i)
+    {
+        if (ascii_lower(a[i]) != ascii_lower(b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t hash_dll(std::string_view name)
+{
+    uint32_t hash = 2166136261u;
+    for (char c : name)
+    {
+        hash = (hash ^ (uint8_t)ascii_lower(c)) * 16777619u;
+    }
+    return hash;
+}
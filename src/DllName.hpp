@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// DLL names are ASCII, and compared case-insensitively by the loader. Names are
+// lower-cased a character at a time as they're compared or hashed, rather
+// than copied.
+
+inline char ascii_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+bool same_dll(char const* a, char const* b);
+bool same_dll(std::string_view a, std::string_view b);
+
+// FNV-1a over the lower-cased name
+uint32_t hash_dll(std::string_view name);
+
+// For hash tables keyed by DLL name
+struct DllHash
+{
+    size_t operator()(std::string_view name) const
+    {
+        return hash_dll(name);
+    }
+};
+
+struct DllEqual
+{
+    bool operator()(std::string_view a, std::string_view b) const
+    {
+        return same_dll(a, b);
+    }
+};
@@ -1,50 +1,269 @@
 #include <File.hpp>
 
 #include <Windows.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
+
+// Address space reserved up front for streamed input so that data() remains
+// stable as the buffer grows. PE images are limited to 4 GiB.
+constexpr static uint64_t stream_reserve = sizeof(void*) == 8 ? 1ull << 32
+                                                               : 1ull << 28;
+// Streamed input is committed and read in chunks of this size
+constexpr static uint64_t stream_chunk = 1ull << 16;
+// Largest single ReadFile/WriteFile request
+constexpr static uint64_t io_chunk = 1ull << 30;
+// Bounds on the delay between attempts to open or lock a busy file, in ms
+constexpr static uint32_t min_backoff = 1;
+constexpr static uint32_t max_backoff = 100;
+
+// Spaces out retries with exponentially increasing delays, until a deadline
+class Backoff
+{
+public:
+    explicit Backoff(uint32_t timeout)
+        : start_{std::chrono::steady_clock::now()}
+        , timeout_{timeout}
+    {
+    }
+
+    // Sleeps before the next attempt, or returns false if the deadline has
+    // passed.
+    bool wait()
+    {
+        uint64_t elapsed = elapsed_us() / 1000;
+        if (elapsed >= timeout_)
+        {
+            return false;
+        }
+
+        // https://learn.microsoft.com/en-us/windows/win32/api/synchapi/nf-synchapi-sleep
+        Sleep((DWORD)std::min<uint64_t>(delay_, timeout_ - elapsed));
+        delay_ = std::min(delay_ * 2, max_backoff);
+        return true;
+    }
+
+    uint64_t elapsed_us() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start_)
+            .count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    uint32_t timeout_;
+    uint32_t delay_ = min_backoff;
+};
 
 File::~File()
 {
     reset();
 }
 
-bool File::load(std::string path, bool writable)
+bool File::load(std::string path,
+                bool writable,
+                FileBackend backend,
+                uint32_t lock_timeout)
 {
     reset();
 
-    path_ = path;
+    path_     = path;
+    writable_ = writable;
+
+    if (path_ == "-")
+    {
+        if (writable)
+        {
+            std::fprintf(stderr, "Cannot modify input read from stdin\n");
+            return false;
+        }
+
+        // https://learn.microsoft.com/en-us/windows/console/getstdhandle
+        file_      = GetStdHandle(STD_INPUT_HANDLE);
+        owns_file_ = false;
+    }
+    else if (!open(lock_timeout))
+    {
+        return false;
+    }
+
+    if (file_ == INVALID_HANDLE_VALUE || file_ == nullptr)
+    {
+        std::fprintf(stderr, "Failed to open file %s\n", path.c_str());
+        file_ = nullptr;
+        return false;
+    }
 
+    // Pipes and character devices can't be mapped or read at an offset
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-getfiletype
+    bool seekable = GetFileType(file_) == FILE_TYPE_DISK;
+    if (!seekable)
+    {
+        backend = FileBackend::Stream;
+    }
+    else if (backend == FileBackend::Auto)
+    {
+        backend = FileBackend::Mapped;
+    }
+    backend_ = backend;
+
+    if (backend_ == FileBackend::Stream)
+    {
+        if (writable)
+        {
+            std::fprintf(
+                stderr, "Cannot modify non-seekable file %s\n", path.c_str());
+            return false;
+        }
+
+        // https://learn.microsoft.com/en-us/windows/win32/api/memoryapi/nf-memoryapi-virtualalloc
+        mutable_data_ = (char*)VirtualAlloc(
+            nullptr, stream_reserve, MEM_RESERVE, PAGE_READWRITE);
+        data_ = mutable_data_;
+
+        if (!data_)
+        {
+            std::fprintf(
+                stderr, "Failed to reserve buffer for %s\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-getfilesizeex
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0)
+    {
+        std::fprintf(stderr, "Failed to query size of %s\n", path.c_str());
+        return false;
+    }
+    size_ = (uint64_t)file_size.QuadPart;
+
+    if (backend_ == FileBackend::Mapped)
+    {
+        return map();
+    }
+
+    // Committed pages are zero-filled on first touch, so only the ranges
+    // actually read ever consume memory.
+    mutable_data_ = (char*)VirtualAlloc(
+        nullptr, size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    data_ = mutable_data_;
+
+    if (!data_)
+    {
+        std::fprintf(stderr, "Failed to reserve buffer for %s\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool File::open(uint32_t lock_timeout)
+{
+    // Readers don't share write access, so that anything writing the file
+    // must finish before they can open it, and a PEachy writer waits for them
+    // in turn. Writers share both, leaving other writers to wait on the lock.
+    DWORD access     = GENERIC_READ | (writable_ ? GENERIC_WRITE : 0);
+    DWORD share      = FILE_SHARE_READ | (writable_ ? FILE_SHARE_WRITE : 0);
+    DWORD attributes = writable_ ? FILE_ATTRIBUTE_NORMAL
+                                 : FILE_ATTRIBUTE_READONLY;
+
+    Backoff backoff{lock_timeout};
+
+    // Processes holding the file in a conflicting mode, such as a linker still
+    // writing it, can only be waited out.
     // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-createfilea
-    if (writable)
+    for (;;)
     {
         file_ = CreateFileA(path_.c_str(),
-                            GENERIC_READ | GENERIC_WRITE,
-                            0,
+                            access,
+                            share,
                             nullptr,
                             OPEN_EXISTING,
-                            FILE_ATTRIBUTE_NORMAL,
+                            attributes,
                             nullptr);
+        if (file_ != INVALID_HANDLE_VALUE)
+        {
+            break;
+        }
+
+        file_ = nullptr;
+        if (GetLastError() != ERROR_SHARING_VIOLATION)
+        {
+            std::fprintf(stderr, "Failed to open file %s\n", path_.c_str());
+            return false;
+        }
+
+        if (!backoff.wait())
+        {
+            std::fprintf(stderr,
+                         "Timed out after %u ms waiting to open %s\n",
+                         lock_timeout,
+                         path_.c_str());
+            return false;
+        }
+        ++lock_retries_;
     }
-    else
+    owns_file_ = true;
+
+    // Pipes and character devices can't be locked, and aren't rewritten
+    if (GetFileType(file_) != FILE_TYPE_DISK)
     {
-        file_ = CreateFileA(path_.c_str(),
-                            GENERIC_READ,
-                            FILE_SHARE_READ,
-                            nullptr,
-                            OPEN_EXISTING,
-                            FILE_ATTRIBUTE_READONLY,
-                            nullptr);
+        lock_wait_us_ = lock_retries_ ? backoff.elapsed_us() : 0;
+        return true;
     }
 
-    if (file_ == INVALID_HANDLE_VALUE)
+    DWORD flags = LOCKFILE_FAIL_IMMEDIATELY
+                  | (writable_ ? LOCKFILE_EXCLUSIVE_LOCK : 0);
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-lockfileex
+    for (;;)
     {
-        std::fprintf(stderr, "Failed to open file %s\n", path.c_str());
-        file_ = nullptr;
-        return false;
+        OVERLAPPED overlapped = {};
+        overlapped.Offset     = (DWORD)lock_offset;
+        overlapped.OffsetHigh = (DWORD)(lock_offset >> 32);
+
+        if (LockFileEx(file_, flags, 0, 1, 0, &overlapped))
+        {
+            locked_ = true;
+            break;
+        }
+
+        // Some network redirectors and filesystem drivers don't implement
+        // byte-range locks, so their files are used unlocked, as they were
+        // before locking was added.
+        if (GetLastError() != ERROR_LOCK_VIOLATION)
+        {
+            std::fprintf(stderr,
+                         "Warning: %s can't be locked, so other processes "
+                         "may use it at the same time\n",
+                         path_.c_str());
+            break;
+        }
+
+        if (!backoff.wait())
+        {
+            std::fprintf(stderr,
+                         "Timed out after %u ms waiting for another process "
+                         "to release %s\n",
+                         lock_timeout,
+                         path_.c_str());
+            return false;
+        }
+        ++lock_retries_;
     }
 
+    lock_wait_us_ = lock_retries_ ? backoff.elapsed_us() : 0;
+    return true;
+}
+
+bool File::map()
+{
     // https://learn.microsoft.com/en-us/windows/win32/api/winbase/nf-winbase-createfilemappinga
-    if (writable)
+    if (writable_)
     {
         mapping_ = CreateFileMappingA(
             file_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
@@ -58,12 +277,12 @@ bool File::load(std::string path, bool writable)
     if (!mapping_)
     {
         std::fprintf(
-            stderr, "Failed to create mapping for file %s\n", path.c_str());
+            stderr, "Failed to create mapping for file %s\n", path_.c_str());
         return false;
     }
 
     // https://learn.microsoft.com/en-us/windows/win32/api/memoryapi/nf-memoryapi-mapviewoffile
-    if (writable)
+    if (writable_)
     {
         mutable_data_ = (char*)MapViewOfFile(
             mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0);
@@ -76,7 +295,8 @@ bool File::load(std::string path, bool writable)
 
     if (!data_)
     {
-        std::fprintf(stderr, "Failed to map view for file %s\n", path.c_str());
+        std::fprintf(
+            stderr, "Failed to map view for file %s\n", path_.c_str());
         return false;
     }
 
@@ -87,8 +307,23 @@ void File::reset()
 {
     if (data_)
     {
-        UnmapViewOfFile(data_);
-        data_ = nullptr;
+        if (backend_ == FileBackend::Mapped)
+        {
+            // Hand edits to the file system before the lock is released, as
+            // network redirectors otherwise write mapped pages back lazily.
+            // https://learn.microsoft.com/en-us/windows/win32/api/memoryapi/nf-memoryapi-flushviewoffile
+            if (writable_)
+            {
+                FlushViewOfFile(data_, 0);
+            }
+            UnmapViewOfFile(data_);
+        }
+        else
+        {
+            VirtualFree(mutable_data_, 0, MEM_RELEASE);
+        }
+        data_         = nullptr;
+        mutable_data_ = nullptr;
     }
 
     if (mapping_)
@@ -99,7 +334,396 @@ void File::reset()
 
     if (file_)
     {
-        CloseHandle(file_);
+        // Closing the handle releases the lock too, but not necessarily
+        // straight away.
+        // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-unlockfileex
+        if (locked_)
+        {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD)lock_offset;
+            overlapped.OffsetHigh = (DWORD)(lock_offset >> 32);
+            UnlockFileEx(file_, 0, 1, 0, &overlapped);
+        }
+
+        if (owns_file_)
+        {
+            CloseHandle(file_);
+        }
         file_ = nullptr;
     }
+
+    backend_      = FileBackend::Auto;
+    owns_file_    = false;
+    eof_          = false;
+    locked_       = false;
+    size_         = 0;
+    committed_    = 0;
+    read_count_   = 0;
+    lock_wait_us_ = 0;
+    lock_retries_ = 0;
+    resident_.clear();
+}
+
+void File::prefetch(std::vector<FileRange> ranges)
+{
+    if (backend_ == FileBackend::Mapped || ranges.empty())
+    {
+        return;
+    }
+
+    if (backend_ == FileBackend::Stream)
+    {
+        // Everything up to the furthest range has to be consumed regardless
+        uint64_t end = 0;
+        for (FileRange const& range : ranges)
+        {
+            end = std::max(end, range.offset + range.size);
+        }
+        read_stream(end);
+        return;
+    }
+
+    // Clamp to the file and discard anything already read
+    std::erase_if(ranges, [this](FileRange& range) {
+        if (range.offset >= size_)
+        {
+            return true;
+        }
+        range.size = std::min(range.size, size_ - range.offset);
+        return range.size == 0 || resident(range.offset, range.size);
+    });
+
+    std::sort(ranges.begin(), ranges.end(), [](auto const& a, auto const& b) {
+        return a.offset < b.offset;
+    });
+
+    // Merge ranges that overlap or are separated by a small gap, so that
+    // e.g. consecutive name strings are read with a single request.
+    FileRange pending = {};
+    bool has_pending  = false;
+    for (FileRange const& range : ranges)
+    {
+        if (has_pending
+            && range.offset <= pending.offset + pending.size + coalesce_gap)
+        {
+            uint64_t end = std::max(pending.offset + pending.size,
+                                    range.offset + range.size);
+            pending.size = end - pending.offset;
+            continue;
+        }
+
+        if (has_pending)
+        {
+            read_at(pending.offset, pending.size);
+        }
+        pending     = range;
+        has_pending = true;
+    }
+
+    if (has_pending)
+    {
+        read_at(pending.offset, pending.size);
+    }
+}
+
+char const* File::fetch(uint64_t offset, uint64_t size)
+{
+    if (!data_ || offset + size < offset)
+    {
+        return nullptr;
+    }
+
+    switch (backend_)
+    {
+    case FileBackend::Stream:
+        if (offset + size > size_ && !read_stream(offset + size))
+        {
+            return nullptr;
+        }
+        break;
+    case FileBackend::Sparse:
+        if (offset + size > size_)
+        {
+            return nullptr;
+        }
+        if (!resident(offset, size)
+            && !read_at(offset,
+                        std::min(std::max(size, read_ahead), size_ - offset)))
+        {
+            return nullptr;
+        }
+        break;
+    default:
+        if (offset + size > size_)
+        {
+            return nullptr;
+        }
+        break;
+    }
+
+    return data_ + offset;
+}
+
+char* File::modify(uint64_t offset, uint64_t size)
+{
+    if (!writable_ || !fetch(offset, size))
+    {
+        return nullptr;
+    }
+    return mutable_data_ + offset;
+}
+
+bool File::commit(uint64_t offset, uint64_t size)
+{
+    if (!writable_ || offset + size < offset || offset + size > size_)
+    {
+        std::fprintf(stderr,
+                     "Write outside of file %s at offset %llu\n",
+                     path_.c_str(),
+                     (unsigned long long)offset);
+        return false;
+    }
+
+    if (backend_ == FileBackend::Mapped)
+    {
+        return true;
+    }
+
+    // Write only the requested bytes through to the file, with a single
+    // request unless the range is enormous
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-writefile
+    for (uint64_t done = 0; done != size;)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset     = (DWORD)(offset + done);
+        overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+
+        DWORD written = 0;
+        DWORD request = (DWORD)std::min(size - done, io_chunk);
+        if (!WriteFile(file_,
+                       mutable_data_ + offset + done,
+                       request,
+                       &written,
+                       &overlapped)
+            || written == 0)
+        {
+            std::fprintf(stderr, "Failed to write file %s\n", path_.c_str());
+            return false;
+        }
+        done += written;
+    }
+
+    return true;
+}
+
+bool File::write(uint64_t offset, void const* src, uint64_t size)
+{
+    if (!writable_ || offset + size < offset || offset + size > size_)
+    {
+        std::fprintf(stderr,
+                     "Write outside of file %s at offset %llu\n",
+                     path_.c_str(),
+                     (unsigned long long)offset);
+        return false;
+    }
+
+    memcpy(mutable_data_ + offset, src, size);
+    if (backend_ == FileBackend::Sparse)
+    {
+        mark_resident(offset, size);
+    }
+    return commit(offset, size);
+}
+
+bool File::resize(uint64_t size)
+{
+    if (!writable_ || size < size_ || backend_ == FileBackend::Stream)
+    {
+        return false;
+    }
+
+    if (size == size_)
+    {
+        return true;
+    }
+
+    // The view must be released before the file can be extended
+    if (backend_ == FileBackend::Mapped)
+    {
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+        data_         = nullptr;
+        mutable_data_ = nullptr;
+        mapping_      = nullptr;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-setendoffile
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    if (!SetFilePointerEx(file_, end, nullptr, FILE_BEGIN)
+        || !SetEndOfFile(file_))
+    {
+        std::fprintf(stderr, "Failed to extend file %s\n", path_.c_str());
+        return false;
+    }
+
+    uint64_t old_size = size_;
+    size_             = size;
+
+    if (backend_ == FileBackend::Mapped)
+    {
+        return map();
+    }
+
+    // Move the resident ranges into a buffer covering the new size. The
+    // extension is known to be zeroed, so it needn't be read.
+    char* data = (char*)VirtualAlloc(
+        nullptr, size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!data)
+    {
+        std::fprintf(stderr, "Failed to grow buffer for %s\n", path_.c_str());
+        return false;
+    }
+
+    for (FileRange const& range : resident_)
+    {
+        memcpy(data + range.offset, data_ + range.offset, range.size);
+    }
+    VirtualFree(mutable_data_, 0, MEM_RELEASE);
+
+    data_         = data;
+    mutable_data_ = data;
+    mark_resident(old_size, size_ - old_size);
+    return true;
+}
+
+bool File::read_at(uint64_t offset, uint64_t size)
+{
+    // https://learn.microsoft.com/en-us/windows/win32/api/fileapi/nf-fileapi-readfile
+    for (uint64_t done = 0; done != size;)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.Offset     = (DWORD)(offset + done);
+        overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+
+        DWORD read    = 0;
+        DWORD request = (DWORD)std::min(size - done, io_chunk);
+        ++read_count_;
+        if (!ReadFile(file_,
+                      mutable_data_ + offset + done,
+                      request,
+                      &read,
+                      &overlapped)
+            || read == 0)
+        {
+            std::fprintf(stderr, "Failed to read file %s\n", path_.c_str());
+            return false;
+        }
+        done += read;
+    }
+
+    mark_resident(offset, size);
+    return true;
+}
+
+bool File::read_stream(uint64_t end)
+{
+    if (end > stream_reserve)
+    {
+        return false;
+    }
+
+    while (size_ < end && !eof_)
+    {
+        if (size_ == committed_)
+        {
+            uint64_t commit = std::min(stream_chunk, stream_reserve - size_);
+            if (!VirtualAlloc(mutable_data_ + committed_,
+                              commit,
+                              MEM_COMMIT,
+                              PAGE_READWRITE))
+            {
+                std::fprintf(
+                    stderr, "Failed to grow buffer for %s\n", path_.c_str());
+                return false;
+            }
+            committed_ += commit;
+        }
+
+        DWORD read = 0;
+        ++read_count_;
+        if (!ReadFile(file_,
+                      mutable_data_ + size_,
+                      (DWORD)(committed_ - size_),
+                      &read,
+                      nullptr))
+        {
+            // The writing end of a pipe closing is the expected end of input
+            if (GetLastError() != ERROR_BROKEN_PIPE)
+            {
+                std::fprintf(stderr, "Failed to read %s\n", path_.c_str());
+                return false;
+            }
+            eof_ = true;
+        }
+        else if (read == 0)
+        {
+            eof_ = true;
+        }
+        size_ += read;
+    }
+
+    return size_ >= end;
+}
+
+bool File::resident(uint64_t offset, uint64_t size) const
+{
+    auto it = std::upper_bound(
+        resident_.begin(),
+        resident_.end(),
+        offset,
+        [](uint64_t offset, FileRange const& range) {
+            return offset < range.offset;
+        });
+
+    if (it == resident_.begin())
+    {
+        return false;
+    }
+    --it;
+    return offset + size <= it->offset + it->size;
+}
+
+void File::mark_resident(uint64_t offset, uint64_t size)
+{
+    auto it = std::upper_bound(
+        resident_.begin(),
+        resident_.end(),
+        offset,
+        [](uint64_t offset, FileRange const& range) {
+            return offset < range.offset;
+        });
+    it = resident_.insert(it, FileRange{offset, size});
+
+    // Fold into the predecessor, then absorb any successors now covered
+    if (it != resident_.begin())
+    {
+        auto prev = it - 1;
+        if (prev->offset + prev->size >= offset)
+        {
+            uint64_t end = std::max(prev->offset + prev->size, offset + size);
+            prev->size   = end - prev->offset;
+            it           = resident_.erase(it) - 1;
+        }
+    }
+
+    auto next = it + 1;
+    while (next != resident_.end() && next->offset <= it->offset + it->size)
+    {
+        uint64_t end = std::max(it->offset + it->size,
+                                next->offset + next->size);
+        it->size     = end - it->offset;
+        next         = resident_.erase(next);
+        it           = next - 1;
+    }
 }
@@ -1,31 +1,142 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
-// Simple memory mapped file
+enum class FileBackend
+{
+    // Memory map seekable files, stream anything else (pipes, consoles)
+    Auto,
+    // Map the entire file into memory
+    Mapped,
+    // Positioned reads of only the byte ranges requested
+    Sparse,
+    // Forward-only buffered reads, for non-seekable input such as stdin
+    Stream,
+};
+
+struct FileRange
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+// File accessor backed either by a memory mapping or by on-demand reads. In
+// all cases, data() is a stable base address for the whole file, but for the
+// non-mapped backends only the ranges made resident via prefetch/fetch are
+// valid to read.
 class File
 {
 public:
+    // Requests separated by fewer than this many bytes are merged into a
+    // single read.
+    constexpr static uint64_t coalesce_gap = 512;
+    // Reads issued on a miss are extended to at least this many bytes, so
+    // that walking a table entry by entry doesn't read each one separately.
+    constexpr static uint64_t read_ahead = 4096;
+    // Files are locked by a byte far past the end of any PE image. No read or
+    // write ever touches it, so the lock is purely advisory.
+    constexpr static uint64_t lock_offset = 1ull << 62;
+    // Longest load() waits for other processes to release the file
+    constexpr static uint32_t default_lock_timeout = 60000;
+
     File() = default;
     ~File();
 
-    bool load(std::string path, bool writable);
+    // A path of "-" reads from stdin. Files on disk are locked until reset:
+    // shared when read-only, so that any number of readers proceed together,
+    // and exclusive when writable. If another process holds a conflicting
+    // lock, or opened the file without sharing, load() retries with backoff
+    // for up to `lock_timeout` milliseconds.
+    bool load(std::string path,
+              bool writable,
+              FileBackend backend   = FileBackend::Auto,
+              uint32_t lock_timeout = default_lock_timeout);
     void reset();
+
     char const* data() const
     {
         return data_;
     }
 
-    char* mutable_data()
+    // Size of the file, or the number of bytes buffered so far for streams
+    uint64_t size() const
+    {
+        return size_;
+    }
+
+    FileBackend backend() const
+    {
+        return backend_;
+    }
+
+    // Number of reads issued to the underlying handle
+    uint32_t read_count() const
     {
-        return mutable_data_;
+        return read_count_;
     }
 
+    // Time load() spent waiting on other processes, and the number of times
+    // it retried opening or locking the file.
+    uint64_t lock_wait_us() const
+    {
+        return lock_wait_us_;
+    }
+
+    uint32_t lock_retries() const
+    {
+        return lock_retries_;
+    }
+
+    // Best-effort hint that the given ranges are about to be read. Adjacent
+    // and overlapping ranges are coalesced into as few reads as possible, and
+    // ranges extending past the end of the file are clamped.
+    void prefetch(std::vector<FileRange> ranges);
+
+    // Returns a pointer to `size` resident bytes at `offset`, or nullptr if
+    // the range lies outside of the file.
+    char const* fetch(uint64_t offset, uint64_t size);
+
+    // Returns a mutable pointer to `size` resident bytes at `offset` for
+    // editing in place, or nullptr if the file isn't writable. Edits reach the
+    // file once committed, or immediately for mapped files. Other PEachy
+    // processes can't see them either way, as they wait on the lock.
+    char* modify(uint64_t offset, uint64_t size);
+    bool commit(uint64_t offset, uint64_t size);
+
+    // Writes through to the file, updating the resident copy if any.
+    bool write(uint64_t offset, void const* src, uint64_t size);
+
+    // Extends a writable file with zeros. data() may change as a result.
+    bool resize(uint64_t size);
+
 private:
+    bool open(uint32_t lock_timeout);
+    bool map();
+    bool read_at(uint64_t offset, uint64_t size);
+    bool read_stream(uint64_t end);
+    bool resident(uint64_t offset, uint64_t size) const;
+    void mark_resident(uint64_t offset, uint64_t size);
+
     std::string path_;
+    FileBackend backend_ = FileBackend::Auto;
+    bool writable_       = false;
+    bool owns_file_      = false;
+    bool eof_            = false;
+    bool locked_         = false;
+
+    void* file_          = nullptr;
+    void* mapping_       = nullptr;
+    char const* data_    = nullptr;
+    char* mutable_data_  = nullptr;
+    uint64_t size_       = 0;
+    uint64_t committed_  = 0;
+    uint32_t read_count_ = 0;
+
+    uint64_t lock_wait_us_ = 0;
+    uint32_t lock_retries_ = 0;
 
-    void* file_         = nullptr;
-    void* mapping_      = nullptr;
-    char const* data_   = nullptr;
-    char* mutable_data_ = nullptr;
+    // Sorted, disjoint ranges read so far by the sparse backend
+    std::vector<FileRange> resident_;
 };
@@ -0,0 +1,136 @@
+#include <ImportLayout.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+constexpr static uint32_t page_size = 4096;
+
+uint32_t count_pages(std::vector<RvaRange> const& ranges)
+{
+    std::vector<uint32_t> pages;
+    for (RvaRange const& range : ranges)
+    {
+        if (range.size == 0)
+        {
+            continue;
+        }
+
+        uint32_t last = (range.rva + range.size - 1) / page_size;
+        for (uint32_t page = range.rva / page_size; page <= last; ++page)
+        {
+            pages.push_back(page);
+        }
+    }
+
+    std::sort(pages.begin(), pages.end());
+    return (uint32_t)(std::unique(pages.begin(), pages.end()) - pages.begin());
+}
+
+ImportLayout layout_imports(std::vector<ImportedModule> const& modules,
+                            uint32_t rva,
+                            uint32_t thunk_size)
+{
+    ImportLayout layout;
+    layout.rva = rva;
+
+    std::vector<char>& bytes = layout.bytes;
+
+    auto align = [&](uint32_t alignment) {
+        bytes.resize((bytes.size() + alignment - 1) & ~(size_t)(alignment - 1));
+    };
+
+    auto append = [&](void const* data, size_t size) {
+        uint32_t at = rva + (uint32_t)bytes.size();
+        bytes.insert(bytes.end(), (char const*)data, (char const*)data + size);
+        return at;
+    };
+
+    auto reserve = [&](size_t size) {
+        uint32_t at = rva + (uint32_t)bytes.size();
+        bytes.resize(bytes.size() + size);
+        return at;
+    };
+
+    // Descriptors are filled in once everything they reference is placed
+    layout.directory_size = (uint32_t)(modules.size() + 1)
+                            * sizeof(ImportDirectoryEntry);
+    reserve(layout.directory_size);
+
+    layout.entries.resize(modules.size());
+    layout.thunks.resize(modules.size());
+
+    // New IATs are kept together so a single IAT directory can cover them
+    for (size_t i = 0; i != modules.size(); ++i)
+    {
+        layout.entries[i] = modules[i].entry;
+        if (modules[i].entry.iat_rva != 0)
+        {
+            continue;
+        }
+
+        align(thunk_size);
+        layout.entries[i].iat_rva = reserve(
+            (modules[i].symbols.size() + 1) * thunk_size);
+
+        if (layout.iat.size == 0)
+        {
+            layout.iat.rva = layout.entries[i].iat_rva;
+        }
+        layout.iat.size = rva + (uint32_t)bytes.size() - layout.iat.rva;
+    }
+
+    uint64_t ordinal_flag = thunk_size == 8 ? 1ull << 63 : 1ull << 31;
+
+    for (size_t i = 0; i != modules.size(); ++i)
+    {
+        ImportedModule const& module = modules[i];
+        ImportDirectoryEntry& entry  = layout.entries[i];
+
+        entry.name_rva = append(module.name, strlen(module.name) + 1);
+
+        align(thunk_size);
+        entry.lookup_table_rva = reserve((module.symbols.size() + 1)
+                                         * thunk_size);
+
+        std::vector<uint64_t>& thunks = layout.thunks[i];
+        thunks.reserve(module.symbols.size());
+
+        for (ImportedSymbol const& symbol : module.symbols)
+        {
+            if (symbol.by_ordinal)
+            {
+                thunks.push_back(ordinal_flag | symbol.ordinal);
+                continue;
+            }
+
+            // Hint/name entries are 2-byte aligned
+            align(2);
+            thunks.push_back(append(&symbol.hint, sizeof(symbol.hint)));
+            append(symbol.name, strlen(symbol.name) + 1);
+        }
+
+        // Thunks are little-endian, as is every host peachy targets
+        for (size_t k = 0; k != thunks.size(); ++k)
+        {
+            memcpy(bytes.data() + entry.lookup_table_rva - rva
+                       + k * thunk_size,
+                   &thunks[k],
+                   thunk_size);
+
+            if (module.entry.iat_rva == 0)
+            {
+                memcpy(bytes.data() + entry.iat_rva - rva + k * thunk_size,
+                       &thunks[k],
+                       thunk_size);
+            }
+        }
+    }
+
+    align(4);
+
+    memcpy(bytes.data(),
+           layout.entries.data(),
+           layout.entries.size() * sizeof(ImportDirectoryEntry));
+
+    return layout;
+}
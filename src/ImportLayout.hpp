@@ -0,0 +1,44 @@
+#pragma once
+
+#include <PE.hpp>
+#include <cstdint>
+#include <vector>
+
+struct RvaRange
+{
+    uint32_t rva;
+    uint32_t size;
+};
+
+// Number of distinct 4 KiB pages covered by a set of ranges
+uint32_t count_pages(std::vector<RvaRange> const& ranges);
+
+// Import structures serialized contiguously, ready to be written at `rva`
+struct ImportLayout
+{
+    uint32_t rva = 0;
+    std::vector<char> bytes;
+
+    // The descriptor table comes first, and is this large including its null
+    // terminator.
+    uint32_t directory_size = 0;
+
+    // New descriptors, in load order
+    std::vector<ImportDirectoryEntry> entries;
+
+    // Values each module's IAT holds on disk before binding, which are the
+    // same as its lookup table.
+    std::vector<std::vector<uint64_t>> thunks;
+
+    // IATs allocated within the layout for modules which didn't have one,
+    // placed together after the descriptor table. Empty if none were needed.
+    RvaRange iat = {};
+};
+
+// Lays out the descriptor table, followed by each module's name, lookup table
+// and hint/name entries, in the order the loader walks them. Modules with an
+// IAT keep it where it is; modules without one (an iat_rva of 0) are given a
+// new IAT in the layout.
+ImportLayout layout_imports(std::vector<ImportedModule> const& modules,
+                            uint32_t rva,
+                            uint32_t thunk_size);
@@ -1,10 +1,19 @@
 #include <PE.hpp>
 
+#include <ApiSet.hpp>
+#include <DllName.hpp>
+#include <ImportLayout.hpp>
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
-#include <unordered_set>
 
-std::unordered_map<std::string, SectionType> section_names = {
+struct SectionName
+{
+    char const* name;
+    SectionType type;
+};
+
+constexpr static SectionName section_names[] = {
     {".debug", SectionType::Debug},
     {".drectve", SectionType::Drectve},
     {".edata", SectionType::Edata},
@@ -17,86 +26,291 @@ std::unordered_map<std::string, SectionType> section_names = {
     {".sxdata", SectionType::SXData},
 };
 
-bool PE::load(char const* data, bool writable)
+// The DOS stub, PE headers and section table almost always fit in the first
+// page, so it's read up front as a single request.
+constexpr static uint64_t header_prefetch = 4096;
+// Initial window read for each name string, doubled until a null is found
+constexpr static uint64_t name_window     = 64;
+constexpr static uint64_t max_name_length = 4096;
+// Checksums are computed over the file in chunks of this size
+constexpr static uint64_t checksum_chunk = 1ull << 16;
+// Name of the section created to hold relocated import structures
+constexpr static char const* import_section_name = ".pidata";
+
+// Sizes of the optional header fields preceding the data directories
+constexpr static uint32_t pe32_header_size
+    = sizeof(OptionalHeader) + 4 + sizeof(OptionalWindowsHeader32);
+constexpr static uint32_t pe32_plus_header_size
+    = sizeof(OptionalHeader) + sizeof(OptionalWindowsHeader32Plus);
+static_assert(pe32_header_size == 96 && pe32_plus_header_size == 112);
+
+static bool is_power_of_two(uint32_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+static uint32_t align_up(uint32_t value, uint32_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Import structures can't go in sections the loader discards or executes
+static bool can_hold_imports(SectionHeader const* section,
+                             SectionFlags required)
+{
+    uint32_t flags = (uint32_t)section->flags;
+    return (flags & (uint32_t)required) == (uint32_t)required
+           && (flags & (uint32_t)SectionFlags::MemDiscardable) == 0
+           && (flags & (uint32_t)SectionFlags::MemExecute) == 0;
+}
+
+char const* describe(Status status)
+{
+    switch (status)
+    {
+    case Status::Ok:
+        return "Success";
+    case Status::InvalidImage:
+        return "Input file is not a valid PE executable";
+    case Status::Truncated:
+        return "PE structure extends past the end of the input";
+    case Status::InvalidImports:
+        return "PE import directory is malformed";
+    case Status::DuplicateDll:
+        return "Escalation list contains duplicate entry";
+    case Status::MissingDll:
+        return "DLL requested for escalation is not present in the PE import "
+               "directory";
+    case Status::ReadOnly:
+        return "Input is not writable";
+    case Status::IOError:
+        return "Failed to write to input";
+    case Status::NoSpace:
+        return "Not enough room in the image to relocate imports";
+    case Status::PolicyViolation:
+        return "Import order doesn't satisfy the policy";
+    case Status::InvalidExports:
+        return "PE export directory is malformed";
+    }
+    return "Unknown error";
+}
+
+Status PE::load(File& file)
+{
+    *this = PE{};
+    file_ = &file;
+    return parse();
+}
+
+Status PE::load(char const* data, size_t size)
+{
+    *this        = PE{};
+    buffer_      = data;
+    buffer_size_ = size;
+    return parse();
+}
+
+Status PE::load(char* data, size_t size)
+{
+    *this           = PE{};
+    buffer_         = data;
+    mutable_buffer_ = data;
+    buffer_size_    = size;
+    return parse();
+}
+
+Status PE::parse()
 {
+    if (file_)
+    {
+        file_->prefetch({{0, header_prefetch}});
+    }
+
+    char const* data = fetch(0, 0x40);
+    if (!data)
+    {
+        return Status::Truncated;
+    }
+
     uint32_t offset;
     memcpy(&offset, data + 0x3c, 4);
 
+    data = fetch(offset, 4 + sizeof(COFFHeader));
+    if (!data)
+    {
+        return Status::Truncated;
+    }
+
     uint32_t sig;
-    memcpy(&sig, data + offset, 4);
+    memcpy(&sig, data, 4);
 
     // "PE\0\0"
-    valid_ = sig == 0x4550;
-
-    if (!valid_)
+    if (sig != 0x4550)
     {
-        return false;
+        return Status::InvalidImage;
     }
 
     offset += 4;
-    header_ = (COFFHeader const*)(data + offset);
-    if ((uint32_t)header_->characteristics
-        & (uint32_t)Characteristics::ExecutableImage == 0)
+    header_ = (COFFHeader const*)(data + 4);
+    if (((uint32_t)header_->characteristics
+         & (uint32_t)Characteristics::ExecutableImage)
+        == 0)
     {
-        std::fprintf(stderr, "PE loaded is not a valid executable file.");
-        return false;
+        return Status::InvalidImage;
     }
     offset += sizeof(COFFHeader);
 
-    uint32_t optional_header_offset = offset;
-
-    optional_header_ = (OptionalHeader const*)(data + offset);
-    offset += sizeof(OptionalHeader);
+    // The optional header and section table follow contiguously
+    data = fetch(offset,
+                 header_->optional_header_size
+                     + header_->section_count * sizeof(SectionHeader));
+    if (!data)
+    {
+        return Status::Truncated;
+    }
 
-    uint32_t data_base;
-    if (optional_header_->magic == OptionalHeaderMagic::PE32)
+    // The fields preceding the data directories must all be present before
+    // any of them can be read.
+    uint32_t header_size = header_->optional_header_size;
+    OptionalHeaderMagic magic;
+    if (header_size < sizeof(magic))
     {
-        memcpy(&data_base, data + offset, 4);
-        offset += 4;
+        return Status::InvalidImage;
+    }
+    memcpy(&magic, data, sizeof(magic));
 
-        win32_header_ = (OptionalWindowsHeader32 const*)(data + offset);
-        offset += sizeof(OptionalWindowsHeader32);
+    uint32_t fixed_size;
+    if (magic == OptionalHeaderMagic::PE32)
+    {
+        fixed_size = pe32_header_size;
+    }
+    else if (magic == OptionalHeaderMagic::PE32Plus)
+    {
+        fixed_size = pe32_plus_header_size;
     }
     else
     {
-        win32_plus_header_ = (OptionalWindowsHeader32Plus const*)(data + offset);
-        offset += sizeof(OptionalWindowsHeader32Plus);
+        return Status::InvalidImage;
     }
 
-    uint32_t sections = directory_count();
+    if (header_size < fixed_size)
+    {
+        return Status::InvalidImage;
+    }
+
+    char const* cursor = data;
 
-    for (uint32_t i = 0; i != sections; ++i)
+    optional_header_ = (OptionalHeader const*)cursor;
+    cursor += sizeof(OptionalHeader);
+
+    if (magic == OptionalHeaderMagic::PE32)
+    {
+        // Skip base_of_data, which is only present in PE32 images
+        cursor += 4;
+        win32_header_ = (OptionalWindowsHeader32 const*)cursor;
+    }
+    else
     {
-        directories[i] = (ImageDataDirectory const*)(data + offset);
-        offset += sizeof(ImageDataDirectory);
+        win32_plus_header_ = (OptionalWindowsHeader32Plus const*)cursor;
     }
-    for (uint32_t i = sections; i != (uint32_t)DataDirectoryType::COUNT; ++i)
+    cursor = data + fixed_size;
+
+    // Alignments are divisors when laying out new data, and the loader
+    // rejects any that aren't powers of two with file alignment the smaller
+    uint32_t section_alignment = windows_header(
+        [](auto const& header) { return header.section_alignment; });
+    uint32_t file_alignment = windows_header(
+        [](auto const& header) { return header.file_alignment; });
+    if (!is_power_of_two(section_alignment) || !is_power_of_two(file_alignment)
+        || file_alignment > section_alignment)
     {
-        directories[i] = nullptr;
+        return Status::InvalidImage;
     }
 
-    if (offset - optional_header_offset != header_->optional_header_size)
+    uint32_t count = directory_count();
+    if (count > (header_size - fixed_size) / sizeof(ImageDataDirectory))
     {
-        std::fprintf(stderr, "PE header parsing inconsistency detected.");
-        return false;
+        return Status::InvalidImage;
     }
 
-    section_headers_.resize(header_->section_count);
+    for (uint32_t i = 0; i != count && i < (uint32_t)DataDirectoryType::COUNT;
+         ++i)
+    {
+        directories[i] = (ImageDataDirectory const*)cursor + i;
+    }
+
+    // The section table follows the optional header, whatever its size
+    sections_ = (SectionHeader const*)(data + header_size);
     for (uint16_t i = 0; i != header_->section_count; ++i)
     {
-        section_headers_[i] = (SectionHeader const*)(data + offset);
-        offset += sizeof(SectionHeader);
+        for (SectionName const& section_name : section_names)
+        {
+            if (strncmp(sections_[i].name,
+                        section_name.name,
+                        sizeof(SectionHeader::name))
+                == 0)
+            {
+                section_index_[(int)section_name.type] = sections_ + i;
+            }
+        }
+    }
 
-        auto it = section_names.find(std::string{section_headers_[i]->name});
-        if (it != section_names.end())
+    ImageDataDirectory const*
+        import_dir = directories[(int)DataDirectoryType::Import];
+    if (!import_dir || import_dir->rva == 0)
+    {
+        return Status::Ok;
+    }
+
+    imports_offset_ = resolve_rva(import_dir->rva);
+    if (imports_offset_ == 0)
+    {
+        return Status::InvalidImports;
+    }
+
+    if (file_)
+    {
+        file_->prefetch({{imports_offset_, import_dir->size}});
+    }
+
+    ImportDirectoryEntry null_entry{};
+    for (uint64_t offset = imports_offset_;;
+         offset += sizeof(ImportDirectoryEntry))
+    {
+        char const* entry = fetch(offset, sizeof(ImportDirectoryEntry));
+        if (!entry)
         {
-            section_index_[it->second] = section_headers_[i];
+            return Status::Truncated;
         }
+
+        if (memcmp(entry, &null_entry, sizeof(ImportDirectoryEntry)) == 0)
+        {
+            break;
+        }
+
+        ++import_count_;
     }
 
-    data_ = data;
+    if (file_)
+    {
+        // Name strings are usually packed together, so fetching them as a
+        // batch lets the sparse and stream backends coalesce them into a
+        // single read.
+        std::vector<FileRange> names;
+        names.reserve(import_count_);
+        for (uint32_t i = 0; i != import_count_; ++i)
+        {
+            ImportDirectoryEntry entry;
+            memcpy(&entry,
+                   fetch(imports_offset_ + i * sizeof(ImportDirectoryEntry),
+                         sizeof(ImportDirectoryEntry)),
+                   sizeof(ImportDirectoryEntry));
+            names.push_back({resolve_rva(entry.name_rva), name_window});
+        }
+        file_->prefetch(std::move(names));
+    }
 
-    return true;
+    return Status::Ok;
 }
 
 uint32_t PE::directory_count() const
@@ -112,195 +326,1212 @@ uint32_t PE::directory_count() const
     return 0;
 }
 
-void PE::examine_imports()
+Status PE::import_at(uint32_t index, Import& import)
 {
-    std::printf("Imports:\n\n");
+    if (index >= import_count_)
+    {
+        return Status::InvalidImports;
+    }
 
-    // https://learn.microsoft.com/en-us/windows/win32/debug/pe-format#the-reloc-section-image-only
-    auto it = section_index_.find(SectionType::Reloc);
-    if (it == section_index_.end())
+    char const* entry = fetch(imports_offset_
+                                  + index * sizeof(ImportDirectoryEntry),
+                              sizeof(ImportDirectoryEntry));
+    if (!entry)
     {
-        return;
+        return Status::Truncated;
     }
+    memcpy(&import.entry, entry, sizeof(ImportDirectoryEntry));
 
-    ImageDataDirectory const*
-        import_dir = directories[(int)DataDirectoryType::Import];
+    // These names will resolve in either .reloc or .idata typically
+    import.name = string_at(import.entry.name_rva);
+    return import.name ? Status::Ok : Status::InvalidImports;
+}
+
+Status PE::plan_escalation(char const* const* dlls,
+                           uint32_t dll_count,
+                           uint32_t* order,
+                           uint32_t* failed_dll)
+{
+    // Both lists are short, so quadratic scans beat building hashed sets
+    for (uint32_t i = 0; i != dll_count; ++i)
+    {
+        for (uint32_t j = 0; j != i; ++j)
+        {
+            if (same_dll(dlls[i], dlls[j]))
+            {
+                if (failed_dll)
+                {
+                    *failed_dll = i;
+                }
+                return Status::DuplicateDll;
+            }
+        }
+    }
 
-    uint32_t import_data_directory_offset = resolve_rva(import_dir->rva);
+    // Escalated DLLs come first, in the order requested
+    uint32_t next = 0;
+    for (uint32_t i = 0; i != dll_count; ++i)
+    {
+        uint32_t found = import_count_;
+        for (uint32_t j = 0; j != import_count_; ++j)
+        {
+            Import import;
+            Status status = import_at(j, import);
+            if (status != Status::Ok)
+            {
+                return status;
+            }
 
-    ImportDirectoryEntry const*
-        entries = (ImportDirectoryEntry const*)(data_
-                                                + import_data_directory_offset);
+            if (same_dll(import.name, dlls[i]))
+            {
+                found = j;
+                break;
+            }
+        }
 
-    int index = 0;
-    ImportDirectoryEntry null_entry{};
-    while (true)
+        if (found == import_count_)
+        {
+            if (failed_dll)
+            {
+                *failed_dll = i;
+            }
+            return Status::MissingDll;
+        }
+
+        order[next++] = found;
+    }
+
+    // The remaining entries stay in their original relative order
+    for (uint32_t j = 0; j != import_count_; ++j)
     {
-        ImportDirectoryEntry const* entry = entries + index;
+        bool escalated = false;
+        for (uint32_t i = 0; i != dll_count; ++i)
+        {
+            escalated |= order[i] == j;
+        }
 
-        if (memcmp(entry, &null_entry, sizeof(ImportDirectoryEntry)) == 0)
+        if (!escalated)
         {
-            break;
+            order[next++] = j;
         }
+    }
+
+    return Status::Ok;
+}
 
-        if (entry->name_rva != 0)
+Status PE::plan_escalation(char const* const* dlls,
+                           uint32_t dll_count,
+                           ApiSet const& apiset,
+                           char const* importer,
+                           uint32_t* order,
+                           uint32_t* failed_dll)
+{
+    for (uint32_t i = 0; i != dll_count; ++i)
+    {
+        for (uint32_t j = 0; j != i; ++j)
         {
-            // These names will resolve in either .reloc or .idata typically
-            char const* name = (char const*)(data_
-                                             + resolve_rva(entry->name_rva));
-            std::printf("    %s\n", name);
+            if (same_dll(dlls[i], dlls[j]))
+            {
+                if (failed_dll)
+                {
+                    *failed_dll = i;
+                }
+                return Status::DuplicateDll;
+            }
+        }
+    }
+
+    // A contract may resolve to a DLL requested earlier, so the imports
+    // escalated so far are checked before adding each one.
+    uint32_t next = 0;
+
+    auto escalated = [&](uint32_t index, uint32_t count) {
+        return std::find(order, order + count, index) != order + count;
+    };
+
+    for (uint32_t i = 0; i != dll_count; ++i)
+    {
+        bool found = false;
+
+        // The DLL itself, then the contracts resolving to it
+        for (bool contracts : {false, true})
+        {
+            for (uint32_t j = 0; j != import_count_; ++j)
+            {
+                Import import;
+                Status status = import_at(j, import);
+                if (status != Status::Ok)
+                {
+                    return status;
+                }
+
+                char const* name = import.name;
+                if (contracts)
+                {
+                    name = apiset.resolve(import.name, importer);
+                }
+                if (!name || !same_dll(name, dlls[i]))
+                {
+                    continue;
+                }
+
+                found = true;
+                if (!escalated(j, next))
+                {
+                    order[next++] = j;
+                }
+            }
         }
 
-        ++index;
+        if (!found)
+        {
+            if (failed_dll)
+            {
+                *failed_dll = i;
+            }
+            return Status::MissingDll;
+        }
+    }
+
+    // The remaining entries stay in their original relative order
+    uint32_t escalated_count = next;
+    for (uint32_t j = 0; j != import_count_; ++j)
+    {
+        if (!escalated(j, escalated_count))
+        {
+            order[next++] = j;
+        }
     }
+
+    return Status::Ok;
 }
 
-bool PE::escalate(std::vector<std::string> const& dlls, char* out_data)
+Status PE::reorder_imports(uint32_t const* order)
 {
-    bool error = false;
-    std::unordered_set<std::string> uniq_dlls;
-    for (std::string const& dll : dlls)
+    for (uint32_t i = 0; i != import_count_; ++i)
     {
-        if (uniq_dlls.contains(dll))
+        if (order[i] >= import_count_)
         {
-            std::fprintf(stderr,
-                         "Escalation list contains duplicate entry %s\n",
-                         dll.c_str());
-            error = true;
+            return Status::InvalidImports;
         }
-        else
+
+        for (uint32_t j = 0; j != i; ++j)
         {
-            uniq_dlls.insert(dll);
+            if (order[i] == order[j])
+            {
+                return Status::InvalidImports;
+            }
         }
     }
 
-    if (error)
+    // Entries outside of [first, last) stay put, so only that span of
+    // descriptor bytes needs to be written back.
+    uint32_t first = 0;
+    while (first != import_count_ && order[first] == first)
     {
-        return false;
+        ++first;
     }
 
-    uint32_t file_offset;
-    std::vector<ImportDirectoryEntry> entries = extract_imports(file_offset);
+    if (first == import_count_)
+    {
+        return Status::Ok;
+    }
 
-    // Ensure all DLLs requested for escalation are present in the import
-    // directory.
+    uint32_t last = import_count_;
+    while (order[last - 1] == last - 1)
+    {
+        --last;
+    }
 
-    std::unordered_map<std::string, ImportDirectoryEntry const*> entries_by_name;
+    uint64_t offset = imports_offset_ + first * sizeof(ImportDirectoryEntry);
+    uint64_t size   = (last - first) * sizeof(ImportDirectoryEntry);
 
-    std::printf("Original import list:\n");
+    char* span = modify(offset, size);
+    if (!span)
+    {
+        return Status::ReadOnly;
+    }
 
-    for (ImportDirectoryEntry const& entry : entries)
+    auto at = [&](uint32_t index) {
+        return span + (index - first) * sizeof(ImportDirectoryEntry);
+    };
+
+    // Apply the permutation one cycle at a time, starting each cycle from
+    // its lowest index so that it is only rotated once.
+    for (uint32_t i = first; i != last; ++i)
     {
-        std::string name = (char const*)(data_ + resolve_rva(entry.name_rva));
-        if (uniq_dlls.contains(name))
+        uint32_t j = order[i];
+        while (j > i)
+        {
+            j = order[j];
+        }
+
+        if (j != i)
         {
-            uniq_dlls.erase(name);
+            continue;
         }
 
-        std::printf("    %s\n", name.c_str());
+        ImportDirectoryEntry saved;
+        memcpy(&saved, at(i), sizeof(ImportDirectoryEntry));
 
-        entries_by_name[name] = &entry;
+        for (j = i; order[j] != i; j = order[j])
+        {
+            memcpy(at(j), at(order[j]), sizeof(ImportDirectoryEntry));
+        }
+        memcpy(at(j), &saved, sizeof(ImportDirectoryEntry));
     }
 
-    std::printf("\n");
+    return commit(offset, size) ? Status::Ok : Status::IOError;
+}
 
-    if (!uniq_dlls.empty())
+Status PE::read_imports(std::vector<ImportedModule>& modules)
+{
+    modules.clear();
+    modules.reserve(import_count_);
+
+    uint32_t thunk        = thunk_size();
+    uint64_t ordinal_flag = thunk == 8 ? 1ull << 63 : 1ull << 31;
+
+    for (uint32_t i = 0; i != import_count_; ++i)
     {
-        std::fprintf(stderr,
-                     "One or more DLLs requested for escalation were not "
-                     "present in the PE import directory:\n");
+        Import import;
+        Status status = import_at(i, import);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
 
-        for (std::string const& dll : uniq_dlls)
+        ImportedModule& module = modules.emplace_back();
+        module.name            = import.name;
+        module.entry           = import.entry;
+
+        // Unbound images may omit the lookup table, in which case the IAT
+        // holds the same thunks until the loader overwrites them.
+        uint32_t table = import.entry.lookup_table_rva;
+        if (table == 0 && import.entry.time_date_stamp == 0)
         {
-            std::fprintf(stderr, "    %s\n", dll.c_str());
+            table = import.entry.iat_rva;
         }
 
-        return false;
+        uint32_t offset = resolve_rva(table);
+        if (offset == 0)
+        {
+            return Status::InvalidImports;
+        }
+
+        for (;; offset += thunk)
+        {
+            char const* data = fetch(offset, thunk);
+            if (!data)
+            {
+                return Status::Truncated;
+            }
+
+            uint64_t value = 0;
+            memcpy(&value, data, thunk);
+            if (value == 0)
+            {
+                break;
+            }
+
+            ImportedSymbol symbol = {};
+            if (value & ordinal_flag)
+            {
+                symbol.by_ordinal = true;
+                symbol.ordinal    = (uint16_t)value;
+            }
+            else
+            {
+                symbol.hint_name_rva = (uint32_t)value & 0x7fffffff;
+
+                uint32_t hint_offset = resolve_rva(symbol.hint_name_rva);
+                char const* hint     = fetch(hint_offset, sizeof(uint16_t));
+                symbol.name          = string_at(symbol.hint_name_rva + 2);
+                if (hint_offset == 0 || !hint || !symbol.name)
+                {
+                    return Status::InvalidImports;
+                }
+                memcpy(&symbol.hint, hint, sizeof(uint16_t));
+            }
+
+            module.symbols.push_back(symbol);
+        }
+    }
+
+    return Status::Ok;
+}
+
+Status PE::read_exports(std::vector<ExportedSymbol>& exports)
+{
+    exports.clear();
+
+    ImageDataDirectory const*
+        export_dir = directories[(int)DataDirectoryType::Export];
+    if (!export_dir || export_dir->rva == 0)
+    {
+        return Status::Ok;
+    }
+
+    uint32_t offset  = resolve_rva(export_dir->rva);
+    char const* data = offset ? fetch(offset, sizeof(ExportDirectory))
+                              : nullptr;
+    if (!data)
+    {
+        return Status::InvalidExports;
+    }
+
+    ExportDirectory directory;
+    memcpy(&directory, data, sizeof(ExportDirectory));
+
+    // Ordinals are 16 bits, so no more addresses can be reached
+    if (directory.address_count > 0x10000
+        || directory.name_count > directory.address_count)
+    {
+        return Status::InvalidExports;
+    }
+
+    auto table = [this](uint32_t rva, uint32_t size) -> char const* {
+        uint32_t offset = resolve_rva(rva);
+        return size == 0 || offset == 0 ? nullptr : fetch(offset, size);
+    };
+
+    char const* addresses = table(directory.address_table_rva,
+                                  directory.address_count * 4);
+    char const* names     = table(directory.name_table_rva,
+                                  directory.name_count * 4);
+    char const* ordinals  = table(directory.ordinal_table_rva,
+                                  directory.name_count * 2);
+    if ((directory.address_count != 0 && !addresses)
+        || (directory.name_count != 0 && (!names || !ordinals)))
+    {
+        return Status::InvalidExports;
+    }
+
+    if (file_)
+    {
+        // As with import names, fetched as a batch so they can be coalesced
+        std::vector<FileRange> ranges;
+        ranges.reserve(directory.name_count);
+        for (uint32_t i = 0; i != directory.name_count; ++i)
+        {
+            uint32_t name_rva;
+            memcpy(&name_rva, names + i * 4, 4);
+            ranges.push_back({resolve_rva(name_rva), name_window});
+        }
+        file_->prefetch(std::move(ranges));
     }
 
-    // Reorder the import entry list, prioritizing the escalated DLLs
+    exports.reserve(directory.address_count);
+    std::vector<bool> named(directory.address_count);
+
+    for (uint32_t i = 0; i != directory.name_count; ++i)
+    {
+        uint32_t name_rva;
+        uint16_t index;
+        memcpy(&name_rva, names + i * 4, 4);
+        memcpy(&index, ordinals + i * 2, 2);
+
+        char const* name = string_at(name_rva);
+        if (!name || index >= directory.address_count)
+        {
+            return Status::InvalidExports;
+        }
 
-    std::vector<ImportDirectoryEntry> reordered;
-    reordered.reserve(entries.size());
+        uint32_t rva;
+        memcpy(&rva, addresses + index * 4, 4);
+        exports.push_back(
+            {name, (uint16_t)(directory.ordinal_base + index), rva});
+        named[index] = true;
+    }
 
-    for (std::string const& dll : dlls)
+    // Unused ordinals between the base and the last export have no address
+    for (uint32_t index = 0; index != directory.address_count; ++index)
     {
-        auto it = entries_by_name.find(dll);
-        reordered.push_back(*it->second);
-        entries_by_name.erase(it);
+        uint32_t rva;
+        memcpy(&rva, addresses + index * 4, 4);
+        if (!named[index] && rva != 0)
+        {
+            exports.push_back(
+                {nullptr, (uint16_t)(directory.ordinal_base + index), rva});
+        }
     }
 
-    for (ImportDirectoryEntry const& entry : entries)
+    return Status::Ok;
+}
+
+Status PE::section_data(char const* name, char const*& data, uint32_t& size)
+{
+    for (uint16_t i = 0; i != header_->section_count; ++i)
+    {
+        SectionHeader const* section = sections_ + i;
+        if (strncmp(section->name, name, sizeof(SectionHeader::name)) != 0)
+        {
+            continue;
+        }
+
+        // Anything past the virtual size is padding
+        size = std::min(section->virtual_size, section->raw_data_size);
+        data = fetch(section->raw_data_offset, size);
+        return data ? Status::Ok : Status::Truncated;
+    }
+
+    return Status::InvalidImage;
+}
+
+Status PE::compact_imports(CompactionReport& report, bool dry_run)
+{
+    report = {};
+
+    std::vector<ImportedModule> modules;
+    Status status = read_imports(modules);
+    if (status != Status::Ok || modules.empty())
+    {
+        return status;
+    }
+
+    uint32_t thunk = thunk_size();
+
+    // Everything the loader reads or writes while resolving imports. IATs
+    // don't move, so they count towards both layouts.
+    std::vector<RvaRange> before;
+    std::vector<RvaRange> iats;
+
+    ImageDataDirectory const*
+        import_dir = directories[(int)DataDirectoryType::Import];
+    before.push_back({import_dir->rva,
+                      (uint32_t)((modules.size() + 1)
+                                 * sizeof(ImportDirectoryEntry))});
+
+    for (ImportedModule const& module : modules)
     {
-        std::string name = (char const*)(data_ + resolve_rva(entry.name_rva));
-        auto it          = entries_by_name.find(name);
-        if (it != entries_by_name.end())
+        uint32_t table_size = (uint32_t)(module.symbols.size() + 1) * thunk;
+
+        before.push_back(
+            {module.entry.name_rva, (uint32_t)strlen(module.name) + 1});
+        if (module.entry.lookup_table_rva != 0)
+        {
+            before.push_back({module.entry.lookup_table_rva, table_size});
+        }
+        iats.push_back({module.entry.iat_rva, table_size});
+
+        for (ImportedSymbol const& symbol : module.symbols)
         {
-            reordered.push_back(*it->second);
+            if (!symbol.by_ordinal)
+            {
+                before.push_back({symbol.hint_name_rva,
+                                  (uint32_t)strlen(symbol.name) + 3});
+            }
         }
     }
+    before.insert(before.end(), iats.begin(), iats.end());
+
+    uint32_t size = (uint32_t)layout_imports(modules, 0, thunk).bytes.size();
+
+    uint32_t rva                 = 0;
+    SectionHeader const* section = find_slack(
+        size, SectionFlags::MemRead, rva);
+    if (!section)
+    {
+        rva = next_section_rva();
+    }
 
-    std::printf("Reordered import list:\n");
-    for (ImportDirectoryEntry const& entry : reordered)
+    // Serialized up front, as adding a section invalidates the names
+    ImportLayout layout = layout_imports(modules, rva, thunk);
+
+    std::vector<RvaRange> after = iats;
+    after.push_back({rva, size});
+
+    report.pages_before = count_pages(before);
+    report.pages_after  = count_pages(after);
+    report.rva          = rva;
+    report.size         = size;
+    report.new_section  = !section;
+
+    if (dry_run || report.pages_after >= report.pages_before)
     {
-        std::string name = (char const*)(data_ + resolve_rva(entry.name_rva));
-        std::printf("    %s\n", name.c_str());
+        return Status::Ok;
     }
 
-    if (!out_data)
+    if (section)
     {
-        // Dry-run assumed
-        return true;
+        // Claim the slack so that the new RVAs resolve
+        if (!write_field(&section->virtual_size,
+                         rva + size - section->virtual_address))
+        {
+            return Status::IOError;
+        }
     }
     else
     {
-        memcpy(out_data + file_offset,
-               (void const*)reordered.data(),
-               reordered.size() * sizeof(ImportDirectoryEntry));
+        uint32_t section_rva;
+        status = add_section(
+            import_section_name,
+            size,
+            (SectionFlags)((uint32_t)SectionFlags::ContainsInitializedData
+                           | (uint32_t)SectionFlags::MemRead),
+            section_rva);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
     }
 
-    return true;
+    if (!write_rva(rva, layout.bytes.data(), size))
+    {
+        return Status::IOError;
+    }
+
+    // Unbound IATs hold a copy of the lookup table on disk, which must point
+    // at the relocated hint/name entries. Bound IATs hold addresses instead.
+    for (size_t i = 0; i != layout.entries.size(); ++i)
+    {
+        if (layout.entries[i].time_date_stamp != 0)
+        {
+            continue;
+        }
+
+        std::vector<uint64_t> const& thunks = layout.thunks[i];
+        std::vector<char> iat(thunks.size() * thunk);
+        for (size_t k = 0; k != thunks.size(); ++k)
+        {
+            memcpy(iat.data() + k * thunk, &thunks[k], thunk);
+        }
+
+        if (!write_rva(layout.entries[i].iat_rva, iat.data(), iat.size()))
+        {
+            return Status::IOError;
+        }
+    }
+
+    status = set_directory(
+        DataDirectoryType::Import, rva, layout.directory_size);
+    if (status != Status::Ok)
+    {
+        return status;
+    }
+
+    report.applied = true;
+    return update_checksum();
 }
 
-std::vector<ImportDirectoryEntry> PE::extract_imports(uint32_t& file_offset)
+Status PE::add_import(char const* dll,
+                      ImportedSymbol const& symbol,
+                      uint32_t position,
+                      ImportAdditionReport& report,
+                      bool dry_run)
 {
-    std::vector<ImportDirectoryEntry> result;
+    report = {};
+
+    if (position > import_count_)
+    {
+        return Status::InvalidImports;
+    }
+
+    // The new descriptor table, including its null terminator
+    std::vector<ImportDirectoryEntry> entries(import_count_ + 2);
+    for (uint32_t i = 0; i != import_count_; ++i)
+    {
+        Import import;
+        Status status = import_at(i, import);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
+
+        if (same_dll(import.name, dll))
+        {
+            return Status::DuplicateDll;
+        }
+        entries[i < position ? i : i + 1] = import.entry;
+    }
+
+    uint32_t table_size = (uint32_t)(entries.size()
+                                     * sizeof(ImportDirectoryEntry));
 
+    // Linkers may declare a directory larger than its descriptors, in which
+    // case the table can grow in place.
     ImageDataDirectory const*
         import_dir = directories[(int)DataDirectoryType::Import];
+    bool in_place  = false;
+    if (import_dir && import_dir->rva != 0 && import_dir->size >= table_size)
+    {
+        char const* spare = fetch(imports_offset_ + table_size
+                                      - sizeof(ImportDirectoryEntry),
+                                  sizeof(ImportDirectoryEntry));
+        in_place = spare
+                   && std::all_of(spare,
+                                  spare + sizeof(ImportDirectoryEntry),
+                                  [](char c) { return c == 0; });
+    }
 
-    file_offset = resolve_rva(import_dir->rva);
+    // The module is laid out with a descriptor table of its own, which is
+    // dropped in favour of the full table. Both tables are multiples of 8
+    // bytes, so shifting the layout over them keeps its alignment.
+    ImportedModule module = {dll, {}, {symbol}};
+    uint32_t thunk        = thunk_size();
+    ImportLayout probe    = layout_imports({module}, 0, thunk);
+    uint32_t module_size  = (uint32_t)probe.bytes.size() - probe.directory_size;
+    uint32_t table_space  = in_place ? 0 : align_up(table_size, 8);
+    uint32_t size         = table_space + module_size;
 
-    ImportDirectoryEntry const*
-        entries = (ImportDirectoryEntry const*)(data_ + file_offset);
+    // The loader writes the new IAT, but only makes the IAT directory
+    // writable while binding, so the IAT must be in a writable section.
+    SectionFlags flags = (SectionFlags)((uint32_t)SectionFlags::MemRead
+                                        | (uint32_t)SectionFlags::MemWrite);
 
-    int index = 0;
-    ImportDirectoryEntry null_entry{};
-    while (true)
+    uint32_t rva                 = 0;
+    SectionHeader const* section = find_slack(size, flags, rva);
+    report.placement             = Placement::Slack;
+    if (!section)
+    {
+        section          = find_extendable(flags, rva);
+        report.placement = Placement::ExtendedSection;
+    }
+    if (!section)
     {
-        ImportDirectoryEntry const* entry = entries + index;
+        rva              = next_section_rva();
+        report.placement = Placement::NewSection;
+    }
 
-        if (memcmp(entry, &null_entry, sizeof(ImportDirectoryEntry)) == 0)
+    ImportLayout layout = layout_imports(
+        {module}, rva + table_space - probe.directory_size, thunk);
+    entries[position] = layout.entries[0];
+
+    report.rva       = rva;
+    report.size      = size;
+    report.relocated = !in_place;
+
+    if (dry_run)
+    {
+        return Status::Ok;
+    }
+
+    Status status = Status::Ok;
+    if (report.placement == Placement::Slack)
+    {
+        if (!write_field(&section->virtual_size,
+                         rva + size - section->virtual_address))
         {
-            break;
+            return Status::IOError;
+        }
+    }
+    else if (report.placement == Placement::ExtendedSection)
+    {
+        status = extend_section(section, rva + size);
+    }
+    else
+    {
+        uint32_t section_rva;
+        status = add_section(
+            import_section_name,
+            size,
+            (SectionFlags)((uint32_t)SectionFlags::ContainsInitializedData
+                           | (uint32_t)flags),
+            section_rva);
+    }
+
+    if (status != Status::Ok)
+    {
+        return status;
+    }
+
+    std::vector<char> block(table_space);
+    if (!in_place)
+    {
+        memcpy(block.data(), entries.data(), table_size);
+    }
+    block.insert(block.end(),
+                 layout.bytes.begin() + probe.directory_size,
+                 layout.bytes.end());
+
+    if (!write_rva(rva, block.data(), block.size()))
+    {
+        return Status::IOError;
+    }
+
+    if (in_place)
+    {
+        if (!write(imports_offset_, entries.data(), table_size))
+        {
+            return Status::IOError;
         }
+    }
+    else
+    {
+        status = set_directory(DataDirectoryType::Import, rva, table_size);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
+    }
 
-        result.push_back(*entry);
-        ++index;
+    status = update_checksum();
+    if (status != Status::Ok)
+    {
+        return status;
     }
 
-    return result;
+    // Reparse so that the new descriptor is counted
+    if (file_)
+    {
+        File& file = *file_;
+        return load(file);
+    }
+    return load(mutable_buffer_, buffer_size_);
 }
 
 uint32_t PE::resolve_rva(uint32_t rva)
 {
-    for (SectionHeader const* section : section_headers_)
+    SectionHeader const* section = section_of(rva);
+    if (!section)
+    {
+        return 0;
+    }
+    return rva - section->virtual_address + section->raw_data_offset;
+}
+
+char const* PE::string_at(uint32_t rva)
+{
+    uint32_t offset = resolve_rva(rva);
+    if (offset == 0)
+    {
+        return nullptr;
+    }
+
+    for (uint64_t window = name_window; window <= max_name_length; window *= 2)
+    {
+        char const* str = fetch(offset, window);
+        if (!str && offset < size())
+        {
+            // The string runs up against the end of the file
+            window = size() - offset;
+            str    = fetch(offset, window);
+            return str && memchr(str, '\0', window) ? str : nullptr;
+        }
+
+        if (!str)
+        {
+            return nullptr;
+        }
+
+        if (memchr(str, '\0', window))
+        {
+            return str;
+        }
+    }
+
+    return nullptr;
+}
+
+uint64_t PE::size() const
+{
+    return file_ ? file_->size() : buffer_size_;
+}
+
+uint64_t PE::offset_of(void const* data) const
+{
+    return (char const*)data - (file_ ? file_->data() : buffer_);
+}
+
+char const* PE::fetch(uint64_t offset, uint64_t size)
+{
+    if (file_)
+    {
+        return file_->fetch(offset, size);
+    }
+
+    if (offset + size < offset || offset + size > buffer_size_)
+    {
+        return nullptr;
+    }
+    return buffer_ + offset;
+}
+
+char* PE::modify(uint64_t offset, uint64_t size)
+{
+    if (file_)
+    {
+        return file_->modify(offset, size);
+    }
+
+    if (!mutable_buffer_ || offset + size < offset
+        || offset + size > buffer_size_)
+    {
+        return nullptr;
+    }
+    return mutable_buffer_ + offset;
+}
+
+bool PE::commit(uint64_t offset, uint64_t size)
+{
+    return file_ ? file_->commit(offset, size) : true;
+}
+
+bool PE::write(uint64_t offset, void const* src, uint64_t size)
+{
+    if (file_)
+    {
+        return file_->write(offset, src, size);
+    }
+
+    char* dst = modify(offset, size);
+    if (!dst)
+    {
+        return false;
+    }
+    memcpy(dst, src, size);
+    return true;
+}
+
+bool PE::write_rva(uint32_t rva, void const* src, uint64_t size)
+{
+    // Only file-backed section data can be written
+    SectionHeader const* section = section_of(rva);
+    if (!section
+        || rva - section->virtual_address + size > section->raw_data_size)
+    {
+        return false;
+    }
+
+    return write(
+        rva - section->virtual_address + section->raw_data_offset, src, size);
+}
+
+uint32_t PE::thunk_size() const
+{
+    return win32_plus_header_ ? 8 : 4;
+}
+
+SectionHeader const* PE::section_of(uint32_t rva) const
+{
+    for (uint16_t i = 0; i != header_->section_count; ++i)
     {
+        SectionHeader const* section = sections_ + i;
         if (rva >= section->virtual_address
             && rva < section->virtual_address + section->virtual_size)
         {
-            return rva - section->virtual_address + section->raw_data_offset;
+            return section;
         }
     }
-    return 0;
+    return nullptr;
+}
+
+uint32_t PE::next_section_rva() const
+{
+    uint32_t alignment = windows_header(
+        [](auto const& header) { return header.section_alignment; });
+
+    uint32_t end = windows_header(
+        [](auto const& header) { return header.image_size; });
+    for (uint16_t i = 0; i != header_->section_count; ++i)
+    {
+        SectionHeader const* section = sections_ + i;
+        end = std::max(end, section->virtual_address + section->virtual_size);
+    }
+    return align_up(end, alignment);
+}
+
+SectionHeader const* PE::find_slack(uint32_t size,
+                                    SectionFlags required,
+                                    uint32_t& rva)
+{
+    uint32_t alignment = windows_header(
+        [](auto const& header) { return header.section_alignment; });
+
+    for (uint16_t i = 0; i != header_->section_count; ++i)
+    {
+        SectionHeader const* section = sections_ + i;
+        if (!can_hold_imports(section, required))
+        {
+            continue;
+        }
+
+        // Growing the section must not change its aligned extent
+        uint32_t data_end = section->virtual_address + section->virtual_size;
+        uint32_t start    = align_up(data_end, 8);
+        uint32_t end      = std::min(
+            section->virtual_address + section->raw_data_size,
+            align_up(data_end, alignment));
+        if (start > end || end - start < size)
+        {
+            continue;
+        }
+
+        // Only claim padding, not data stashed past the end of the section
+        char const* slack = fetch(section->raw_data_offset + start
+                                      - section->virtual_address,
+                                  size);
+        if (!slack
+            || std::any_of(slack, slack + size, [](char c) { return c != 0; }))
+        {
+            continue;
+        }
+
+        rva = start;
+        return section;
+    }
+
+    return nullptr;
+}
+
+SectionHeader const* PE::find_extendable(SectionFlags required, uint32_t& rva)
+{
+    uint32_t file_alignment = windows_header(
+        [](auto const& header) { return header.file_alignment; });
+
+    SectionHeader const* last = nullptr;
+    uint64_t data_end         = 0;
+    for (uint16_t i = 0; i != header_->section_count; ++i)
+    {
+        SectionHeader const* section = sections_ + i;
+        if (!last || section->virtual_address > last->virtual_address)
+        {
+            last = section;
+        }
+        data_end = std::max<uint64_t>(
+            data_end, section->raw_data_offset + section->raw_data_size);
+    }
+
+    // Neither another section's data nor an overlay (such as a certificate)
+    // may follow the section's data in the file.
+    if (!last || !can_hold_imports(last, required)
+        || last->raw_data_size == 0
+        || last->raw_data_offset + last->raw_data_size != data_end
+        || size() > align_up((uint32_t)data_end, file_alignment))
+    {
+        return nullptr;
+    }
+
+    rva = align_up(last->virtual_address + last->virtual_size, 8);
+
+    // Only claim padding, not data stashed past the end of the section
+    uint32_t start = rva - last->virtual_address;
+    if (start < last->raw_data_size)
+    {
+        uint32_t length     = last->raw_data_size - start;
+        char const* padding = fetch(last->raw_data_offset + start, length);
+        if (!padding
+            || std::any_of(
+                padding, padding + length, [](char c) { return c != 0; }))
+        {
+            return nullptr;
+        }
+    }
+
+    return last;
+}
+
+Status PE::extend_section(SectionHeader const* section, uint32_t end)
+{
+    uint32_t section_alignment = windows_header(
+        [](auto const& header) { return header.section_alignment; });
+    uint32_t file_alignment = windows_header(
+        [](auto const& header) { return header.file_alignment; });
+
+    uint32_t index         = (uint32_t)(section - sections_);
+    uint32_t virtual_size  = end - section->virtual_address;
+    uint32_t raw_data_size = std::max(section->raw_data_size,
+                                      align_up(virtual_size, file_alignment));
+    uint32_t growth        = raw_data_size - section->raw_data_size;
+    uint32_t image_size    = std::max(
+        windows_header([](auto const& header) { return header.image_size; }),
+        align_up(end, section_alignment));
+
+    uint64_t file_end = (uint64_t)section->raw_data_offset + raw_data_size;
+    if (file_end > size())
+    {
+        Status status = grow(file_end);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
+        section = sections_ + index;
+    }
+
+    if (!write_field(&section->virtual_size, virtual_size)
+        || !write_field(&section->raw_data_size, raw_data_size)
+        || !write_field(windows_header([](auto const& header) {
+                            return &header.image_size;
+                        }),
+                        image_size))
+    {
+        return Status::IOError;
+    }
+
+    if ((uint32_t)section->flags
+        & (uint32_t)SectionFlags::ContainsInitializedData)
+    {
+        if (!write_field(&optional_header_->initialized_data_size,
+                         optional_header_->initialized_data_size + growth))
+        {
+            return Status::IOError;
+        }
+    }
+
+    return Status::Ok;
+}
+
+Status PE::add_section(char const* name,
+                       uint32_t virtual_size,
+                       SectionFlags flags,
+                       uint32_t& rva)
+{
+    uint32_t section_alignment = windows_header(
+        [](auto const& header) { return header.section_alignment; });
+    uint32_t file_alignment = windows_header(
+        [](auto const& header) { return header.file_alignment; });
+
+    // The new header must fit between the section table and the first
+    // section's data, in space nothing else (such as bound imports) uses.
+    uint64_t table_end = offset_of(sections_ + header_->section_count);
+    uint64_t limit     = windows_header(
+        [](auto const& header) { return header.header_size; });
+    uint64_t data_end = 0;
+    for (uint16_t i = 0; i != header_->section_count; ++i)
+    {
+        SectionHeader const* section = sections_ + i;
+        if (section->raw_data_size == 0)
+        {
+            continue;
+        }
+        limit    = std::min<uint64_t>(limit, section->raw_data_offset);
+        data_end = std::max<uint64_t>(
+            data_end, section->raw_data_offset + section->raw_data_size);
+    }
+
+    char const* gap = fetch(table_end, sizeof(SectionHeader));
+    if (table_end + sizeof(SectionHeader) > limit || !gap
+        || std::any_of(gap, gap + sizeof(SectionHeader), [](char c) {
+               return c != 0;
+           }))
+    {
+        return Status::NoSpace;
+    }
+
+    // Section data is appended to the file, which can't carry an overlay
+    // (such as a certificate) that would end up inside the new section.
+    data_end = align_up((uint32_t)data_end, file_alignment);
+    if (size() > data_end)
+    {
+        return Status::NoSpace;
+    }
+
+    SectionHeader section = {};
+    strncpy(section.name, name, sizeof(section.name));
+    section.virtual_size    = virtual_size;
+    section.virtual_address = next_section_rva();
+    section.raw_data_size   = align_up(virtual_size, file_alignment);
+    section.raw_data_offset = (uint32_t)data_end;
+    section.flags           = flags;
+
+    Status status = grow(data_end + section.raw_data_size);
+    if (status != Status::Ok)
+    {
+        return status;
+    }
+
+    uint32_t image_size = align_up(
+        section.virtual_address + section.virtual_size, section_alignment);
+
+    if (!write(table_end, &section, sizeof(SectionHeader))
+        || !write_field(&header_->section_count,
+                        (uint16_t)(header_->section_count + 1))
+        || !write_field(windows_header([](auto const& header) {
+                            return &header.image_size;
+                        }),
+                        image_size))
+    {
+        return Status::IOError;
+    }
+
+    if ((uint32_t)flags & (uint32_t)SectionFlags::ContainsInitializedData)
+    {
+        if (!write_field(&optional_header_->initialized_data_size,
+                         optional_header_->initialized_data_size
+                             + section.raw_data_size))
+        {
+            return Status::IOError;
+        }
+    }
+
+    rva = section.virtual_address;
+    return Status::Ok;
+}
+
+Status PE::grow(uint64_t size)
+{
+    if (!file_)
+    {
+        return Status::NoSpace;
+    }
+
+    if (!file_->resize(size))
+    {
+        return Status::IOError;
+    }
+
+    File& file = *file_;
+    return load(file);
+}
+
+Status PE::set_directory(DataDirectoryType type, uint32_t rva, uint32_t size)
+{
+    ImageDataDirectory const* directory = directories[(int)type];
+    if (!directory)
+    {
+        return Status::InvalidImage;
+    }
+
+    return write_field(directory, ImageDataDirectory{rva, size})
+               ? Status::Ok
+               : Status::IOError;
+}
+
+Status PE::update_checksum()
+{
+    uint32_t const* field = windows_header(
+        [](auto const& header) { return &header.checksum; });
+    if (*field == 0)
+    {
+        return Status::Ok;
+    }
+
+    // https://learn.microsoft.com/en-us/windows/win32/api/imagehlp/nf-imagehlp-checksummappedfile
+    // The sum of all 16-bit words, with carries folded back in, excluding the
+    // checksum itself, plus the file size.
+    uint64_t field_offset = offset_of(field);
+    uint64_t total        = size();
+    uint64_t sum          = 0;
+
+    for (uint64_t offset = 0; offset < total; offset += checksum_chunk)
+    {
+        uint64_t length  = std::min(checksum_chunk, total - offset);
+        char const* data = fetch(offset, length);
+        if (!data)
+        {
+            return Status::Truncated;
+        }
+
+        for (uint64_t i = 0; i < length; i += 2)
+        {
+            if (offset + i >= field_offset && offset + i < field_offset + 4)
+            {
+                continue;
+            }
+
+            uint32_t word = (uint8_t)data[i];
+            if (i + 1 < length)
+            {
+                word |= (uint32_t)(uint8_t)data[i + 1] << 8;
+            }
+
+            sum += word;
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+    }
+
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    return write_field(field, (uint32_t)(sum + total)) ? Status::Ok
+                                                        : Status::IOError;
 }
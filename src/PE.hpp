@@ -1,10 +1,12 @@
 #pragma once
 
+#include <File.hpp>
+#include <cstddef>
 #include <cstdint>
-#include <string>
-#include <unordered_map>
 #include <vector>
 
+class ApiSet;
+
 // https://learn.microsoft.com/en-us/windows/win32/debug/pe-format
 
 // https://learn.microsoft.com/en-us/windows/win32/debug/pe-format#machine-types
@@ -275,13 +277,14 @@ enum class SectionType
     Rsrc,
     Cormeta,
     SXData,
+    COUNT
 };
 
 // https://learn.microsoft.com/en-us/windows/win32/debug/pe-format#section-table-section-headers
 struct SectionHeader
 {
     // 8-byte null-padded UTF-8-encoded string.
-    char const name[8];
+    char name[8];
     uint32_t virtual_size;
     uint32_t virtual_address;
     uint32_t raw_data_size;
@@ -303,33 +306,286 @@ struct ImportDirectoryEntry
     uint32_t iat_rva;
 };
 
+// https://learn.microsoft.com/en-us/windows/win32/debug/pe-format#export-directory-table
+struct ExportDirectory
+{
+    uint32_t flags; // Must be 0
+    uint32_t time_date_stamp;
+    struct
+    {
+        uint16_t major;
+        uint16_t minor;
+    } version;
+    uint32_t name_rva;
+    uint32_t ordinal_base;
+    uint32_t address_count;
+    uint32_t name_count;
+    uint32_t address_table_rva;
+    uint32_t name_table_rva;
+    uint32_t ordinal_table_rva;
+};
+
+enum class Status
+{
+    Ok,
+    // Not a PE image, or its headers are inconsistent
+    InvalidImage,
+    // A structure extends past the end of the input
+    Truncated,
+    // An import descriptor or its name doesn't resolve
+    InvalidImports,
+    // An escalation list names the same DLL twice, or an added DLL is already
+    // imported
+    DuplicateDll,
+    // An escalation list names a DLL which isn't imported
+    MissingDll,
+    // A modification was requested on read-only input
+    ReadOnly,
+    IOError,
+    // Neither slack in an existing section nor room for a new section header
+    NoSpace,
+    // The import order doesn't satisfy a policy
+    PolicyViolation,
+    // The export directory or one of its tables doesn't resolve
+    InvalidExports,
+};
+
+char const* describe(Status status);
+
+struct Import
+{
+    // Points into the image, and remains valid for the lifetime of the PE
+    char const* name;
+    ImportDirectoryEntry entry;
+};
+
+struct ImportedSymbol
+{
+    bool by_ordinal;
+    uint16_t ordinal;
+    uint16_t hint;
+    // Points into the image. Null when imported by ordinal.
+    char const* name;
+    uint32_t hint_name_rva;
+};
+
+struct ImportedModule
+{
+    char const* name;
+    ImportDirectoryEntry entry;
+    std::vector<ImportedSymbol> symbols;
+};
+
+struct ExportedSymbol
+{
+    // Points into the image. Null when only exported by ordinal.
+    char const* name;
+    uint16_t ordinal;
+    uint32_t rva;
+};
+
+struct CompactionReport
+{
+    // Distinct pages read or written by the loader while walking the imports
+    uint32_t pages_before;
+    uint32_t pages_after;
+    // Where the import structures were placed
+    uint32_t rva;
+    uint32_t size;
+    bool new_section;
+    // False if the relayout would not reduce the number of pages touched
+    bool applied;
+};
+
+// Where new import structures were placed
+enum class Placement
+{
+    // Zeroed padding at the end of an existing section
+    Slack,
+    // The last section, grown along with the file
+    ExtendedSection,
+    NewSection,
+};
+
+struct ImportAdditionReport
+{
+    // The new module's name, lookup table, hint/name entry and IAT, preceded
+    // by the descriptor table if it was relocated.
+    uint32_t rva;
+    uint32_t size;
+    Placement placement;
+    // False if the descriptor table had room for one more entry in place
+    bool relocated;
+};
+
+// Parses PE headers and the import directory without allocating. Every
+// accessor reports failure through a Status rather than printing.
 class PE
 {
 public:
-    bool load(char const* data, bool writable);
+    // Headers and sections are read from the file on demand, so the file must
+    // outlive the PE.
+    Status load(File& file);
+
+    // Parse an image already held in memory. The buffer must outlive the PE,
+    // and must be mutable for reorder_imports to succeed.
+    Status load(char const* data, size_t size);
+    Status load(char* data, size_t size);
 
     uint32_t directory_count() const;
 
-    void examine_imports();
+    // Number of descriptors in the import directory, in load order
+    uint32_t import_count() const
+    {
+        return import_count_;
+    }
+
+    Status import_at(uint32_t index, Import& import);
 
-    // Scan the import directory to ensure all dlls requested are present. Then,
-    // resort the directory entries, inserting the requested dlls in front.
-    bool escalate(std::vector<std::string> const& dlls, char* out_data);
+    // Scan the import directory to ensure all dlls requested are present,
+    // matching names case-insensitively as the loader does. Then, compute the
+    // load order with the requested dlls in front, writing the original index
+    // of each import into `order`, which must hold import_count() entries. On DuplicateDll or MissingDll, `failed_dll`
+    // receives the index of the offending entry in `dlls`.
+    Status plan_escalation(char const* const* dlls,
+                           uint32_t dll_count,
+                           uint32_t* order,
+                           uint32_t* failed_dll = nullptr);
+
+    // As above, except that each requested DLL also escalates every API set
+    // contract resolving to it. The DLL
+    // itself comes first, followed by its contracts in load order. Requesting
+    // a contract by name escalates just that contract. `importer`, this
+    // image's file name if known, selects any hosts particular to it.
+    Status plan_escalation(char const* const* dlls,
+                           uint32_t dll_count,
+                           ApiSet const& apiset,
+                           char const* importer,
+                           uint32_t* order,
+                           uint32_t* failed_dll = nullptr);
+
+    // Permutes the import directory in place so that slot i holds the entry
+    // previously at order[i]. Only the descriptor bytes that change are
+    // written back.
+    Status reorder_imports(uint32_t const* order);
+
+    // Reads every import descriptor along with the symbols in its lookup
+    // table.
+    Status read_imports(std::vector<ImportedModule>& modules);
+
+    // Reads every export, named exports first in name table order, followed
+    // by those only exported by ordinal. Images without an export directory
+    // have none.
+    Status read_exports(std::vector<ExportedSymbol>& exports);
+
+    // Fetches the file-backed data of the first section named `name`, or
+    // returns InvalidImage if there is none.
+    Status section_data(char const* name, char const*& data, uint32_t& size);
+
+    // Relays the import descriptors, lookup tables, hint/name entries and DLL
+    // names contiguously in load order, either in slack at the end of an
+    // existing section or in a new section. IAT addresses are unchanged. For
+    // buffers, only slack can be used.
+    Status compact_imports(CompactionReport& report, bool dry_run);
+
+    // Inserts a descriptor importing `symbol` from `dll` so that it loads at
+    // `position`, which may be import_count() to load it last. The new
+    // structures are placed in writable slack, the last section or a new
+    // section, along with a relocated descriptor table when the current one
+    // has no room. Unless dry-running, the imports are reparsed afterwards.
+    Status add_import(char const* dll,
+                      ImportedSymbol const& symbol,
+                      uint32_t position,
+                      ImportAdditionReport& report,
+                      bool dry_run);
 
 private:
-    std::vector<ImportDirectoryEntry> extract_imports(uint32_t& file_offset);
+    Status parse();
 
     // Translates an RVA to a file offset
     uint32_t resolve_rva(uint32_t rva);
 
-    char const* data_;
-    bool valid_ = false;
+    // Returns the null-terminated string at the RVA, or nullptr if the RVA
+    // doesn't resolve or the string is unterminated.
+    char const* string_at(uint32_t rva);
+
+    // Size of entries in import lookup tables and IATs
+    uint32_t thunk_size() const;
+
+    // Reads a field common to the PE32 and PE32+ windows headers
+    template <typename F>
+    auto windows_header(F&& field) const
+    {
+        return win32_header_ ? field(*win32_header_)
+                             : field(*win32_plus_header_);
+    }
+
+    SectionHeader const* section_of(uint32_t rva) const;
+
+    // Section-aligned RVA following the last section
+    uint32_t next_section_rva() const;
+
+    // Finds zeroed, file-backed space after the end of the data of a section
+    // with the `required` flags, which can hold `size` bytes without moving
+    // any other section.
+    SectionHeader const* find_slack(uint32_t size,
+                                    SectionFlags required,
+                                    uint32_t& rva);
+
+    // Returns the section ending both the image and the file if it has the
+    // `required` flags, and nothing follows it which growing would overwrite.
+    // `rva` receives where data appended to the section would start.
+    SectionHeader const* find_extendable(SectionFlags required, uint32_t& rva);
+
+    // Grows a section found by find_extendable to end at `end`, growing the
+    // file. Headers are reparsed, invalidating any pointers into the image.
+    Status extend_section(SectionHeader const* section, uint32_t end);
+
+    // Appends a section header and zeroed section data, growing the file.
+    // Headers are reparsed, invalidating any pointers into the image.
+    Status add_section(char const* name,
+                       uint32_t virtual_size,
+                       SectionFlags flags,
+                       uint32_t& rva);
+
+    // Extends the file, then reparses the headers
+    Status grow(uint64_t size);
+
+    Status set_directory(DataDirectoryType type, uint32_t rva, uint32_t size);
+
+    // Recomputes the image checksum, unless the image doesn't carry one
+    Status update_checksum();
+
+    // Access to the underlying file or buffer
+    uint64_t size() const;
+    uint64_t offset_of(void const* data) const;
+    char const* fetch(uint64_t offset, uint64_t size);
+    char* modify(uint64_t offset, uint64_t size);
+    bool commit(uint64_t offset, uint64_t size);
+    bool write(uint64_t offset, void const* src, uint64_t size);
+    bool write_rva(uint32_t rva, void const* src, uint64_t size);
+
+    template <typename T>
+    bool write_field(T const* field, T value)
+    {
+        return write(offset_of(field), &value, sizeof(T));
+    }
+
+    File* file_           = nullptr;
+    char const* buffer_   = nullptr;
+    char* mutable_buffer_ = nullptr;
+    uint64_t buffer_size_ = 0;
 
     COFFHeader const* header_                             = nullptr;
     OptionalHeader const* optional_header_                = nullptr;
     OptionalWindowsHeader32 const* win32_header_          = nullptr;
     OptionalWindowsHeader32Plus const* win32_plus_header_ = nullptr;
     ImageDataDirectory const* directories[(int)DataDirectoryType::COUNT] = {};
-    std::vector<SectionHeader const*> section_headers_;
-    std::unordered_map<SectionType, SectionHeader const*> section_index_;
+
+    // Section headers are contiguous in the image
+    SectionHeader const* sections_                               = nullptr;
+    SectionHeader const* section_index_[(int)SectionType::COUNT] = {};
+
+    uint32_t imports_offset_ = 0;
+    uint32_t import_count_   = 0;
 };
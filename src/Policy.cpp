@@ -0,0 +1,267 @@
+#include <Policy.hpp>
+
+#include <DllName.hpp>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+// DLL names are limited to MAX_PATH, so longer names can't match a rule
+constexpr static size_t max_name_length = 260;
+
+static bool glob_match(std::string_view pattern, std::string_view name)
+{
+    // Greedy matching which backtracks only to the most recent *
+    size_t p      = 0;
+    size_t n      = 0;
+    size_t star   = std::string_view::npos;
+    size_t resume = 0;
+
+    while (n != name.size())
+    {
+        bool more = p != pattern.size();
+        if (more && (pattern[p] == '?' || pattern[p] == name[n]))
+        {
+            ++p;
+            ++n;
+        }
+        else if (more && pattern[p] == '*')
+        {
+            star   = p++;
+            resume = n;
+        }
+        else if (star != std::string_view::npos)
+        {
+            p = star + 1;
+            n = ++resume;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while (p != pattern.size() && pattern[p] == '*')
+    {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+bool Policy::parse(std::string_view text, std::string& error)
+{
+    rules_.clear();
+    exact_.clear();
+    globs_.clear();
+
+    bool has_fallback = false;
+    uint32_t line     = 0;
+
+    while (!text.empty())
+    {
+        size_t end            = text.find('\n');
+        std::string_view rule = text.substr(0, end);
+        text.remove_prefix(end == std::string_view::npos ? text.size()
+                                                         : end + 1);
+        ++line;
+
+        while (!rule.empty() && std::isspace((unsigned char)rule.front()))
+        {
+            rule.remove_prefix(1);
+        }
+        while (!rule.empty() && std::isspace((unsigned char)rule.back()))
+        {
+            rule.remove_suffix(1);
+        }
+
+        if (rule.empty() || rule.front() == '#')
+        {
+            continue;
+        }
+
+        if (std::any_of(rule.begin(), rule.end(), [](char c) {
+                return std::isspace((unsigned char)c);
+            }))
+        {
+            error = "line " + std::to_string(line)
+                    + ": rules can't contain whitespace";
+            return false;
+        }
+
+        uint32_t rank = (uint32_t)rules_.size();
+        rules_.emplace_back(rule);
+
+        std::string pattern{rule};
+        std::transform(
+            pattern.begin(), pattern.end(), pattern.begin(), ascii_lower);
+
+        if (pattern == "*")
+        {
+            if (has_fallback)
+            {
+                error = "line " + std::to_string(line)
+                        + ": only one rule may be a lone *";
+                return false;
+            }
+            has_fallback = true;
+            fallback_    = rank;
+        }
+        else if (pattern.find_first_of("*?") != std::string::npos)
+        {
+            globs_.push_back({std::move(pattern), rank});
+        }
+        else
+        {
+            // Later duplicates can never match first
+            exact_.emplace(std::move(pattern), rank);
+        }
+    }
+
+    if (!has_fallback)
+    {
+        fallback_ = (uint32_t)rules_.size();
+    }
+
+    return true;
+}
+
+bool Policy::load(std::string const& path, std::string& error)
+{
+    std::ifstream stream{path, std::ios::binary};
+    if (!stream)
+    {
+        error = "failed to open " + path;
+        return false;
+    }
+
+    std::stringstream text;
+    text << stream.rdbuf();
+    return parse(text.str(), error);
+}
+
+std::string_view Policy::rule(uint32_t rank) const
+{
+    if (rank < rules_.size())
+    {
+        return rules_[rank];
+    }
+    return "<unmatched>";
+}
+
+uint32_t Policy::rank(char const* name) const
+{
+    char buffer[max_name_length];
+    size_t length = 0;
+    for (; name[length] != '\0'; ++length)
+    {
+        if (length == max_name_length)
+        {
+            return fallback_;
+        }
+        buffer[length] = ascii_lower(name[length]);
+    }
+    std::string_view lowered{buffer, length};
+
+    uint32_t rank = UINT32_MAX;
+
+    auto it = exact_.find(lowered);
+    if (it != exact_.end())
+    {
+        rank = it->second;
+    }
+
+    // Only globs ranked ahead of an exact match can take precedence over it.
+    // Globs written after a lone * still apply, as * only stands for imports
+    // no other rule matches.
+    for (Glob const& glob : globs_)
+    {
+        if (glob.rank >= rank)
+        {
+            break;
+        }
+
+        if (glob_match(glob.pattern, lowered))
+        {
+            return glob.rank;
+        }
+    }
+
+    return rank == UINT32_MAX ? fallback_ : rank;
+}
+
+uint32_t Policy::rank(char const* name,
+                      ApiSet const* apiset,
+                      char const* importer) const
+{
+    uint32_t own     = rank(name);
+    char const* host = apiset ? apiset->resolve(name, importer) : nullptr;
+    if (!host)
+    {
+        return own;
+    }
+
+    uint32_t resolved = rank(host);
+    if (own == fallback_)
+    {
+        return resolved;
+    }
+    else if (resolved == fallback_)
+    {
+        return own;
+    }
+    return std::min(own, resolved);
+}
+
+Status Policy::plan(PE& pe,
+                    uint32_t* order,
+                    ApiSet const* apiset,
+                    char const* importer) const
+{
+    std::vector<uint32_t> ranks(pe.import_count());
+    for (uint32_t i = 0; i != pe.import_count(); ++i)
+    {
+        Import import;
+        Status status = pe.import_at(i, import);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
+
+        ranks[i] = rank(import.name, apiset, importer);
+        order[i] = i;
+    }
+
+    std::stable_sort(
+        order, order + pe.import_count(), [&](uint32_t a, uint32_t b) {
+            return ranks[a] < ranks[b];
+        });
+
+    return Status::Ok;
+}
+
+Status Policy::verify(PE& pe,
+                      uint32_t& violation,
+                      ApiSet const* apiset,
+                      char const* importer) const
+{
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i != pe.import_count(); ++i)
+    {
+        Import import;
+        Status status = pe.import_at(i, import);
+        if (status != Status::Ok)
+        {
+            return status;
+        }
+
+        uint32_t current = rank(import.name, apiset, importer);
+        if (current < previous)
+        {
+            violation = i;
+            return Status::PolicyViolation;
+        }
+        previous = current;
+    }
+
+    return Status::Ok;
+}
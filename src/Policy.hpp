@@ -0,0 +1,83 @@
+#pragma once
+
+#include <ApiSet.hpp>
+#include <PE.hpp>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// An ordered list of DLL name globs, compiled once for fast case-insensitive
+// matching. Each import ranks by the first rule it matches, and a policy is
+// satisfied when ranks never decrease along the load order.
+class Policy
+{
+public:
+    // One rule per line. Blank lines and lines starting with # are ignored.
+    // Rules may contain * and ? wildcards, and a lone * ranks everything no
+    // other rule matches. Without one, unmatched imports rank after all rules.
+    bool parse(std::string_view text, std::string& error);
+    bool load(std::string const& path, std::string& error);
+
+    uint32_t rule_count() const
+    {
+        return (uint32_t)rules_.size();
+    }
+
+    // The rule as written, or "<unmatched>" for the implicit final rank
+    std::string_view rule(uint32_t rank) const;
+
+    uint32_t rank(char const* name) const;
+
+    // With a schema, API set contracts rank by the first rule matching either
+    // their own name or their host DLL's. A lone * only applies if neither
+    // matches another rule. `importer`, the file name of the image importing
+    // the contract, selects any host particular to it.
+    uint32_t rank(char const* name,
+                  ApiSet const* apiset,
+                  char const* importer = nullptr) const;
+
+    // Computes the load order satisfying the policy which moves the fewest
+    // imports: a stable sort by rank. `order` receives the original index of
+    // each import, as with PE::plan_escalation.
+    Status plan(PE& pe,
+                uint32_t* order,
+                ApiSet const* apiset = nullptr,
+                char const* importer = nullptr) const;
+
+    // On PolicyViolation, `violation` receives the index of the first import
+    // ranked ahead of the import loaded before it.
+    Status verify(PE& pe,
+                  uint32_t& violation,
+                  ApiSet const* apiset = nullptr,
+                  char const* importer = nullptr) const;
+
+private:
+    struct Glob
+    {
+        std::string pattern;
+        uint32_t rank;
+    };
+
+    struct Hash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view name) const
+        {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    std::vector<std::string> rules_;
+
+    // Lower-cased rules without wildcards, which the bulk of rules are
+    std::unordered_map<std::string, uint32_t, Hash, std::equal_to<>> exact_;
+
+    // Lower-cased rules with wildcards, in rank order
+    std::vector<Glob> globs_;
+
+    // Rank of anything no rule matches
+    uint32_t fallback_ = 0;
+};
@@ -1,21 +1,952 @@
 #include <CLI11/CLI11.hpp>
 
+#include <ApiSet.hpp>
+#include <Diff.hpp>
+#include <DllName.hpp>
 #include <File.hpp>
 #include <PE.hpp>
+#include <Policy.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <thread>
+
+// A parsed PE along with the file backing it
+struct Input
+{
+    std::string path;
+    File file;
+    PE pe;
+
+    // The file name without its directory, which a few API set contracts
+    // resolve differently for
+    std::string importer;
+
+    // Import names in load order, pointing into the file
+    std::vector<char const*> names;
+};
+
+// How long to wait for other processes to release an input, in milliseconds
+static uint32_t lock_timeout = File::default_lock_timeout;
+
+// Resolves API set contracts to their hosts, if a schema was given
+static ApiSet const* apiset = nullptr;
+
+// Prints an import, along with the DLL it resolves to if it's an API set
+static void print_import(Input const& input, char const* name)
+{
+    char const* host = apiset ? apiset->resolve(name, input.importer.c_str())
+                              : nullptr;
+    if (host)
+    {
+        std::printf("    %s -> %s\n", name, host);
+    }
+    else
+    {
+        std::printf("    %s\n", name);
+    }
+}
+
+static bool open(Input& input,
+                 std::string const& path,
+                 bool writable,
+                 FileBackend backend)
+{
+    input.path     = path;
+    input.importer = path.substr(path.find_last_of("/\\") + 1);
+    if (!input.file.load(path, writable, backend, lock_timeout))
+    {
+        return false;
+    }
+
+    // Contention is reported so that builds which serialize on an input can
+    // be spotted from their logs.
+    if (input.file.lock_retries() != 0)
+    {
+        std::fprintf(stderr,
+                     "%s: waited %.1f ms for other processes (%u retries)\n",
+                     path.c_str(),
+                     input.file.lock_wait_us() / 1000.0,
+                     input.file.lock_retries());
+    }
+
+    Status status = input.pe.load(input.file);
+    if (status != Status::Ok)
+    {
+        std::fprintf(stderr, "%s: %s\n", path.c_str(), describe(status));
+        return false;
+    }
+
+    input.names.resize(input.pe.import_count());
+    for (uint32_t i = 0; i != input.pe.import_count(); ++i)
+    {
+        Import import;
+        status = input.pe.import_at(i, import);
+        if (status != Status::Ok)
+        {
+            std::fprintf(stderr, "%s: %s\n", path.c_str(), describe(status));
+            return false;
+        }
+        input.names[i] = import.name;
+    }
+
+    return true;
+}
+
+// Prints the reordered import list, then writes it back unless dry-running
+static bool reorder(Input& input,
+                    std::vector<uint32_t> const& order,
+                    bool dry_run)
+{
+    std::printf("Reordered import list:\n");
+    for (uint32_t index : order)
+    {
+        print_import(input, input.names[index]);
+    }
+
+    if (dry_run)
+    {
+        return true;
+    }
+
+    Status status = input.pe.reorder_imports(order.data());
+    if (status != Status::Ok)
+    {
+        std::fprintf(
+            stderr, "%s: %s\n", input.path.c_str(), describe(status));
+        return false;
+    }
+    return true;
+}
+
+static void print_original(Input const& input)
+{
+    std::printf("Original import list:\n");
+    for (char const* name : input.names)
+    {
+        print_import(input, name);
+    }
+    std::printf("\n");
+}
+
+static int list_imports(std::string const& path, FileBackend backend)
+{
+    Input input;
+    if (!open(input, path, false, backend))
+    {
+        return 1;
+    }
+
+    std::printf("Imports:\n\n");
+    for (char const* name : input.names)
+    {
+        print_import(input, name);
+    }
+
+    return 0;
+}
+
+static int escalate_imports(std::string const& path,
+                            std::vector<std::string> const& dlls,
+                            bool dry_run,
+                            FileBackend backend)
+{
+    Input input;
+    if (!open(input, path, !dry_run, backend))
+    {
+        return 1;
+    }
+
+    print_original(input);
+
+    std::vector<char const*> requested;
+    for (std::string const& dll : dlls)
+    {
+        requested.push_back(dll.c_str());
+    }
+
+    std::vector<uint32_t> order(input.pe.import_count());
+    auto plan = [&](char const* const* list,
+                    uint32_t count,
+                    uint32_t* failed_dll) {
+        if (apiset)
+        {
+            return input.pe.plan_escalation(list,
+                                            count,
+                                            *apiset,
+                                            input.importer.c_str(),
+                                            order.data(),
+                                            failed_dll);
+        }
+        return input.pe.plan_escalation(list, count, order.data(), failed_dll);
+    };
+
+    uint32_t failed_dll = 0;
+    Status status       = plan(
+        requested.data(), (uint32_t)requested.size(), &failed_dll);
+
+    if (status == Status::DuplicateDll)
+    {
+        std::fprintf(stderr,
+                     "Escalation list contains duplicate entry %s\n",
+                     requested[failed_dll]);
+        return 1;
+    }
+    else if (status == Status::MissingDll)
+    {
+        std::fprintf(stderr,
+                     "One or more DLLs requested for escalation were not "
+                     "present in the PE import directory:\n");
+
+        // Each DLL is planned alone, so that every missing one is reported
+        for (char const* dll : requested)
+        {
+            if (plan(&dll, 1, nullptr) == Status::MissingDll)
+            {
+                std::fprintf(stderr, "    %s\n", dll);
+            }
+        }
+        return 1;
+    }
+    else if (status != Status::Ok)
+    {
+        std::fprintf(stderr, "%s\n", describe(status));
+        return 1;
+    }
+
+    return reorder(input, order, dry_run) ? 0 : 1;
+}
+
+static int escalate_policy(Policy const& policy,
+                           std::vector<std::string> const& paths,
+                           bool dry_run,
+                           FileBackend backend)
+{
+    int result = 0;
+    for (std::string const& path : paths)
+    {
+        if (paths.size() > 1)
+        {
+            std::printf("%s:\n", path.c_str());
+        }
+
+        Input input;
+        if (!open(input, path, !dry_run, backend))
+        {
+            result = 1;
+            continue;
+        }
+
+        print_original(input);
+
+        std::vector<uint32_t> order(input.pe.import_count());
+        Status status = policy.plan(
+            input.pe, order.data(), apiset, input.importer.c_str());
+        if (status != Status::Ok)
+        {
+            std::fprintf(stderr, "%s: %s\n", path.c_str(), describe(status));
+            result = 1;
+            continue;
+        }
+
+        if (!reorder(input, order, dry_run))
+        {
+            result = 1;
+        }
+
+        if (paths.size() > 1)
+        {
+            std::printf("\n");
+        }
+    }
+
+    return result;
+}
+
+// Installs hold plenty of files which aren't images, which are skipped rather
+// than reported as invalid.
+static bool is_image(std::string const& path)
+{
+    char magic[2] = {};
+    std::ifstream stream{path, std::ios::binary};
+    return stream.read(magic, sizeof(magic)) && magic[0] == 'M'
+           && magic[1] == 'Z';
+}
+
+// Lists the regular files under a directory, recursively
+static bool list_files(std::filesystem::path const& root,
+                       std::vector<std::filesystem::path>& files)
+{
+    namespace fs = std::filesystem;
+
+    std::error_code error;
+    fs::recursive_directory_iterator it{
+        root, fs::directory_options::skip_permission_denied, error};
+    for (; !error && it != fs::recursive_directory_iterator{};
+         it.increment(error))
+    {
+        if (it->is_regular_file(error))
+        {
+            files.push_back(it->path());
+        }
+    }
+
+    if (error)
+    {
+        std::fprintf(stderr,
+                     "Failed to list %s: %s\n",
+                     root.string().c_str(),
+                     error.message().c_str());
+        return false;
+    }
+    return true;
+}
+
+// Expands each directory argument into the images under it, in sorted order,
+// and each @file argument into the paths it lists one per line, so inputs
+// needn't fit on a command line or rely on the shell expanding wildcards
+static bool expand_inputs(std::vector<std::string> const& arguments,
+                          std::vector<std::string>& paths)
+{
+    std::vector<std::string> inputs;
+    for (std::string const& argument : arguments)
+    {
+        if (argument.empty() || argument[0] != '@')
+        {
+            inputs.push_back(argument);
+            continue;
+        }
+
+        std::ifstream stream{argument.substr(1)};
+        if (!stream)
+        {
+            std::fprintf(stderr,
+                         "Failed to open response file %s\n",
+                         argument.c_str() + 1);
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            if (!line.empty())
+            {
+                inputs.push_back(line);
+            }
+        }
+    }
+
+    for (std::string const& input : inputs)
+    {
+        if (!std::filesystem::is_directory(input))
+        {
+            paths.push_back(input);
+            continue;
+        }
+
+        std::vector<std::filesystem::path> files;
+        if (!list_files(input, files))
+        {
+            return false;
+        }
+
+        std::sort(files.begin(), files.end());
+        for (std::filesystem::path const& file : files)
+        {
+            std::string path = file.string();
+            if (is_image(path))
+            {
+                paths.push_back(std::move(path));
+            }
+        }
+    }
+
+    if (paths.empty())
+    {
+        std::fprintf(stderr, "No PE inputs found\n");
+        return false;
+    }
+    return true;
+}
+
+static int verify_policy(Policy const& policy,
+                         std::vector<std::string> const& paths,
+                         uint32_t jobs,
+                         FileBackend backend)
+{
+    // Workers claim inputs until they run out or any input fails
+    std::atomic<size_t> next  = 0;
+    std::atomic<bool> failed = false;
+
+    auto verify = [&]() {
+        while (!failed)
+        {
+            size_t index = next++;
+            if (index >= paths.size())
+            {
+                return;
+            }
+
+            Input input;
+            if (!open(input, paths[index], false, backend))
+            {
+                failed = true;
+                return;
+            }
+
+            char const* importer = input.importer.c_str();
+            uint32_t violation   = 0;
+            Status status        = policy.verify(
+                input.pe, violation, apiset, importer);
+            if (status == Status::PolicyViolation)
+            {
+                char const* name   = input.names[violation];
+                char const* before = input.names[violation - 1];
+                std::string_view rule = policy.rule(
+                    policy.rank(name, apiset, importer));
+                std::string_view before_rule = policy.rule(
+                    policy.rank(before, apiset, importer));
+
+                std::fprintf(stderr,
+                             "%s: %s (rule %.*s) loads after %s "
+                             "(rule %.*s)\n",
+                             input.path.c_str(),
+                             name,
+                             (int)rule.size(),
+                             rule.data(),
+                             before,
+                             (int)before_rule.size(),
+                             before_rule.data());
+                failed = true;
+            }
+            else if (status != Status::Ok)
+            {
+                std::fprintf(stderr,
+                             "%s: %s\n",
+                             input.path.c_str(),
+                             describe(status));
+                failed = true;
+            }
+        }
+    };
+
+    jobs = std::clamp<uint32_t>(jobs, 1, (uint32_t)paths.size());
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        workers.emplace_back(verify);
+    }
+    verify();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    if (failed)
+    {
+        return 1;
+    }
+
+    std::printf("%zu inputs satisfy the policy.\n", paths.size());
+    return 0;
+}
+
+static int compact_imports(std::string const& path,
+                           bool dry_run,
+                           FileBackend backend)
+{
+    Input input;
+    if (!open(input, path, !dry_run, backend))
+    {
+        return 1;
+    }
+
+    CompactionReport report;
+    Status status = input.pe.compact_imports(report, dry_run);
+    if (status != Status::Ok)
+    {
+        std::fprintf(stderr, "%s\n", describe(status));
+        return 1;
+    }
+
+    if (report.size == 0)
+    {
+        std::printf("No imports to compact.\n");
+        return 0;
+    }
+
+    std::printf("Import structures: %u bytes at RVA 0x%x (%s)\n",
+                report.size,
+                report.rva,
+                report.new_section ? "new section" : "existing slack");
+    std::printf("Pages touched by the import walk:\n");
+    std::printf("    Before: %u\n", report.pages_before);
+    std::printf("    After:  %u\n", report.pages_after);
+
+    if (!dry_run && !report.applied)
+    {
+        std::printf("\nLeft unchanged, as relaying would not reduce the "
+                    "pages touched.\n");
+    }
+
+    return 0;
+}
+
+static int add_import(std::string const& path,
+                      std::string const& dll,
+                      std::string const& symbol_name,
+                      uint32_t position,
+                      bool dry_run,
+                      FileBackend backend)
+{
+    // Without a symbol, ordinal 1 is imported, which every DLL with exports
+    // has unless it was linked with a different ordinal base.
+    ImportedSymbol symbol = {};
+    if (symbol_name.empty())
+    {
+        symbol.by_ordinal = true;
+        symbol.ordinal    = 1;
+    }
+    else if (symbol_name[0] == '#')
+    {
+        char* end             = nullptr;
+        unsigned long ordinal = std::strtoul(symbol_name.c_str() + 1, &end, 10);
+        if (end == symbol_name.c_str() + 1 || *end != '\0' || ordinal == 0
+            || ordinal > 0xffff)
+        {
+            std::fprintf(stderr, "Invalid ordinal %s\n", symbol_name.c_str());
+            return 1;
+        }
+        symbol.by_ordinal = true;
+        symbol.ordinal    = (uint16_t)ordinal;
+    }
+    else
+    {
+        symbol.name = symbol_name.c_str();
+    }
+
+    Input input;
+    if (!open(input, path, !dry_run, backend))
+    {
+        return 1;
+    }
+
+    uint32_t count = input.pe.import_count();
+    if (position == UINT32_MAX)
+    {
+        position = count;
+    }
+    else if (position > count)
+    {
+        std::fprintf(stderr,
+                     "Position %u is past the end of the %u imports\n",
+                     position,
+                     count);
+        return 1;
+    }
+
+    // Planned first, so that nothing is printed for an import which can't be
+    // added.
+    ImportAdditionReport report;
+    Status status = input.pe.add_import(
+        dll.c_str(), symbol, position, report, true);
+    if (status == Status::DuplicateDll)
+    {
+        std::fprintf(stderr, "%s is already imported\n", dll.c_str());
+        return 1;
+    }
+    else if (status != Status::Ok)
+    {
+        std::fprintf(stderr, "%s\n", describe(status));
+        return 1;
+    }
+
+    print_original(input);
+
+    // Printed before adding the import, which invalidates the names
+    std::printf("New import list:\n");
+    for (uint32_t i = 0; i <= count; ++i)
+    {
+        std::printf("    %s\n",
+                    i == position ? dll.c_str()
+                                  : input.names[i < position ? i : i - 1]);
+    }
+    std::printf("\n");
+
+    if (!dry_run)
+    {
+        status = input.pe.add_import(
+            dll.c_str(), symbol, position, report, false);
+        if (status != Status::Ok)
+        {
+            std::fprintf(stderr, "%s\n", describe(status));
+            return 1;
+        }
+    }
+
+    char const* placements[] = {
+        "existing slack",
+        "extended section",
+        "new section",
+    };
+    std::printf("Import structures: %u bytes at RVA 0x%x (%s)\n",
+                report.size,
+                report.rva,
+                placements[(int)report.placement]);
+    std::printf("Import directory: %s\n",
+                report.relocated ? "relocated" : "extended in place");
+
+    return 0;
+}
+
+// Appends printf-style output, so that reports formatted on worker threads
+// can be printed in order.
+static void append(std::string& out, char const* format, ...)
+{
+    va_list args;
+    va_list copy;
+    va_start(args, format);
+    va_copy(copy, args);
+
+    // Measured first, as symbol names can be thousands of characters long
+    int length = std::vsnprintf(nullptr, 0, format, args);
+    if (length > 0)
+    {
+        size_t start = out.size();
+        out.resize(start + length + 1);
+        std::vsnprintf(out.data() + start, length + 1, format, copy);
+        out.resize(start + length);
+    }
+
+    va_end(copy);
+    va_end(args);
+}
+
+template <typename Symbol>
+static void append_symbol(std::string& out,
+                          char const* indent,
+                          char sign,
+                          Symbol const& symbol)
+{
+    if (symbol.name)
+    {
+        append(out, "%s%c %s\n", indent, sign, symbol.name);
+    }
+    else
+    {
+        append(out, "%s%c #%u\n", indent, sign, symbol.ordinal);
+    }
+}
+
+// Formats every change, with `indent` before each line
+static void append_diff(std::string& out,
+                        char const* indent,
+                        ImageDiff const& diff)
+{
+    if (!diff.added_dlls.empty())
+    {
+        append(out, "%sAdded DLLs:\n", indent);
+        for (char const* name : diff.added_dlls)
+        {
+            append(out, "%s    %s\n", indent, name);
+        }
+    }
+
+    if (!diff.removed_dlls.empty())
+    {
+        append(out, "%sRemoved DLLs:\n", indent);
+        for (char const* name : diff.removed_dlls)
+        {
+            append(out, "%s    %s\n", indent, name);
+        }
+    }
+
+    if (!diff.moved_dlls.empty())
+    {
+        append(out, "%sReordered DLLs:\n", indent);
+        for (MovedImport const& moved : diff.moved_dlls)
+        {
+            append(out,
+                   "%s    %s: %u -> %u\n",
+                   indent,
+                   moved.name,
+                   moved.old_index,
+                   moved.new_index);
+        }
+    }
+
+    if (!diff.symbols.empty())
+    {
+        std::string nested = std::string{indent} + "        ";
+        append(out, "%sImported symbols:\n", indent);
+        for (SymbolChanges const& dll : diff.symbols)
+        {
+            append(out, "%s    %s:\n", indent, dll.dll);
+            for (ImportedSymbol const& symbol : dll.added)
+            {
+                append_symbol(out, nested.c_str(), '+', symbol);
+            }
+            for (ImportedSymbol const& symbol : dll.removed)
+            {
+                append_symbol(out, nested.c_str(), '-', symbol);
+            }
+        }
+    }
+
+    if (!diff.added_exports.empty() || !diff.removed_exports.empty())
+    {
+        std::string nested = std::string{indent} + "    ";
+        append(out, "%sExports:\n", indent);
+        for (ExportedSymbol const& symbol : diff.added_exports)
+        {
+            append_symbol(out, nested.c_str(), '+', symbol);
+        }
+        for (ExportedSymbol const& symbol : diff.removed_exports)
+        {
+            append_symbol(out, nested.c_str(), '-', symbol);
+        }
+    }
+}
+
+// An image in either or both of the directories being compared, along with
+// its formatted report
+struct DiffEntry
+{
+    std::string name;
+    std::string old_path;
+    std::string new_path;
+
+    std::string report;
+    uint32_t changes = 0;
+    bool failed      = false;
+};
+
+static void diff_entry(DiffEntry& entry, FileBackend backend)
+{
+    bool old_image = !entry.old_path.empty() && is_image(entry.old_path);
+    bool new_image = !entry.new_path.empty() && is_image(entry.new_path);
+
+    if (!old_image && !new_image)
+    {
+        return;
+    }
+    else if (!old_image)
+    {
+        entry.changes = (uint32_t)Change::AddedImage;
+        append(entry.report, "%s: added\n", entry.name.c_str());
+        return;
+    }
+    else if (!new_image)
+    {
+        entry.changes = (uint32_t)Change::RemovedImage;
+        append(entry.report, "%s: removed\n", entry.name.c_str());
+        return;
+    }
+
+    Input before;
+    Input after;
+    if (!open(before, entry.old_path, false, backend)
+        || !open(after, entry.new_path, false, backend))
+    {
+        entry.failed = true;
+        return;
+    }
+
+    ImageDiff diff;
+    Status status = diff_images(before.pe, after.pe, diff);
+    if (status != Status::Ok)
+    {
+        std::fprintf(stderr, "%s: %s\n", entry.name.c_str(), describe(status));
+        entry.failed = true;
+        return;
+    }
+
+    entry.changes = diff.changes();
+    if (entry.changes != 0)
+    {
+        append(entry.report, "%s:\n", entry.name.c_str());
+        append_diff(entry.report, "    ", diff);
+    }
+}
+
+// Pairs up the files under both directories by their case-insensitive
+// relative paths, in sorted order.
+static bool list_pairs(std::string const& old_root,
+                       std::string const& new_root,
+                       std::vector<DiffEntry>& entries)
+{
+    namespace fs = std::filesystem;
+
+    std::map<std::string, DiffEntry> pairs;
+    for (bool is_new : {false, true})
+    {
+        fs::path root = is_new ? new_root : old_root;
+
+        std::vector<fs::path> files;
+        if (!list_files(root, files))
+        {
+            return false;
+        }
+
+        for (fs::path const& file : files)
+        {
+            std::string name = file.lexically_relative(root).generic_string();
+            std::string key  = name;
+            std::transform(key.begin(), key.end(), key.begin(), ascii_lower);
+
+            DiffEntry& entry = pairs[key];
+            entry.name       = name;
+            (is_new ? entry.new_path : entry.old_path) = file.string();
+        }
+    }
+
+    entries.reserve(pairs.size());
+    for (auto& [key, entry] : pairs)
+    {
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+// Exits with 1 if any change in `fail_on` was found, or 2 on failure
+static int diff_inputs(std::string const& old_path,
+                       std::string const& new_path,
+                       uint32_t fail_on,
+                       uint32_t jobs,
+                       FileBackend backend)
+{
+    bool old_directory = std::filesystem::is_directory(old_path);
+    bool new_directory = std::filesystem::is_directory(new_path);
+    if (old_directory != new_directory)
+    {
+        std::fprintf(stderr, "Cannot compare a directory with a file\n");
+        return 2;
+    }
+
+    if (!old_directory)
+    {
+        Input before;
+        Input after;
+        if (!open(before, old_path, false, backend)
+            || !open(after, new_path, false, backend))
+        {
+            return 2;
+        }
+
+        ImageDiff diff;
+        Status status = diff_images(before.pe, after.pe, diff);
+        if (status != Status::Ok)
+        {
+            std::fprintf(stderr, "%s\n", describe(status));
+            return 2;
+        }
+
+        std::string report;
+        append_diff(report, "", diff);
+        std::fputs(report.empty() ? "No changes.\n" : report.c_str(), stdout);
+        return (diff.changes() & fail_on) != 0 ? 1 : 0;
+    }
+
+    std::vector<DiffEntry> entries;
+    if (!list_pairs(old_path, new_path, entries))
+    {
+        return 2;
+    }
+
+    // Unlike verify, every pair is compared even once one fails
+    std::atomic<size_t> next = 0;
+
+    auto compare = [&]() {
+        for (size_t index = next++; index < entries.size(); index = next++)
+        {
+            diff_entry(entries[index], backend);
+        }
+    };
+
+    jobs = std::min(std::max(jobs, 1u), (uint32_t)entries.size());
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 1; i < jobs; ++i)
+    {
+        workers.emplace_back(compare);
+    }
+    compare();
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    uint32_t changes = 0;
+    size_t changed   = 0;
+    bool failed      = false;
+    for (DiffEntry const& entry : entries)
+    {
+        std::fputs(entry.report.c_str(), stdout);
+        changes |= entry.changes;
+        changed += entry.changes != 0;
+        failed = failed || entry.failed;
+    }
+    std::printf("%zu images changed.\n", changed);
+
+    if (failed)
+    {
+        return 2;
+    }
+    return (changes & fail_on) != 0 ? 1 : 0;
+}
 
 int main(int argc, char* argv[])
 {
     CLI::App app{"PEachy - a small PE (Portable Executable) file manipulator."};
 
+    app.add_option("--lock-timeout",
+                   lock_timeout,
+                   "Milliseconds to wait for other processes using an input "
+                   "before giving up.");
+
+    std::string apiset_path;
+    app.add_option("--apiset",
+                   apiset_path,
+                   "API Set schema used to resolve api-ms-win-* and ext-ms-* "
+                   "imports to the DLLs which actually load: "
+                   "apisetschema.dll, or a raw copy of its .apiset section.");
+
     std::string input;
 
+    FileBackend backend = FileBackend::Auto;
+    std::map<std::string, FileBackend> backends = {
+        {"auto", FileBackend::Auto},
+        {"mmap", FileBackend::Mapped},
+        {"pread", FileBackend::Sparse},
+        {"stream", FileBackend::Stream},
+    };
+    char const* backend_help
+        = "How the input is read: mapped (mmap), with positioned reads of only "
+          "the bytes needed (pread, for network filesystems), or forward-only "
+          "(stream). Non-seekable input is always streamed.";
+
     CLI::App* list = app.add_subcommand(
         "list", "List the modules in the import section in load-order.");
-    list->add_option("input", input, "Path to PE input.")->required();
+    list->add_option("input", input, "Path to PE input, or - for stdin.")
+        ->required();
+    list->add_option("--io", backend, backend_help)
+        ->transform(CLI::CheckedTransformer(backends, CLI::ignore_case));
 
-    // CLI::App_p escalate = std::make_shared<CLI::App>("escalate");
     std::vector<std::string> dlls;
+    std::string policy_path;
     CLI::App* escalate = app.add_subcommand(
         "escalate", "Escalate the loading order of an ordered list of DLLs.");
     escalate->add_option("input", input, "Path to PE input.")->required();
@@ -23,46 +954,178 @@ int main(int argc, char* argv[])
     escalate->add_flag("-d,--dry-run",
                        dry_run,
                        "Emit the target import order without making changes.");
+    escalate->add_option("--io", backend, backend_help)
+        ->transform(CLI::CheckedTransformer(backends, CLI::ignore_case));
+    escalate->add_option(
+        "--policy",
+        policy_path,
+        "Order imports by the rules in a policy file instead. Any further "
+        "arguments are then additional inputs.");
     escalate->add_option(
         "dlls",
         dlls,
         "Ordered space-separated list of DLLs to load as early as possible.");
 
-    app.require_subcommand();
+    CLI::App* compact = app.add_subcommand(
+        "compact-imports",
+        "Relay the import structures contiguously in load order, to minimize "
+        "the pages touched at startup.");
+    compact->add_option("input", input, "Path to PE input.")->required();
+    compact->add_flag("-d,--dry-run",
+                      dry_run,
+                      "Report the pages touched without making changes.");
+    compact->add_option("--io", backend, backend_help)
+        ->transform(CLI::CheckedTransformer(backends, CLI::ignore_case));
 
-    CLI11_PARSE(app, argc, argv);
+    std::string dll;
+    std::string symbol;
+    uint32_t position = UINT32_MAX;
+    CLI::App* add = app.add_subcommand(
+        "add-import",
+        "Add a DLL to the import section without relinking.");
+    add->add_option("input", input, "Path to PE input.")->required();
+    add->add_option("dll", dll, "Name of the DLL to import.")->required();
+    add->add_option("symbol",
+                    symbol,
+                    "Symbol to import from the DLL, or #N for ordinal N. "
+                    "Defaults to ordinal 1.");
+    add->add_option("-p,--position",
+                    position,
+                    "Load order position of the new import, from 0. Defaults "
+                    "to loading it last.");
+    add->add_flag("-d,--dry-run",
+                  dry_run,
+                  "Report where the import would be placed without making "
+                  "changes.");
+    add->add_option("--io", backend, backend_help)
+        ->transform(CLI::CheckedTransformer(backends, CLI::ignore_case));
 
-    bool writable = escalate->parsed() && !dry_run;
+    std::vector<std::string> inputs;
+    uint32_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    CLI::App* verify = app.add_subcommand(
+        "verify",
+        "Check that the import order of every input satisfies a policy, "
+        "without making changes.");
+    verify->add_option("inputs",
+                       inputs,
+                       "Paths to PE inputs, directories to check every image "
+                       "under, or @file to read paths from a file, one per "
+                       "line.")
+        ->required();
+    verify->add_option("--policy", policy_path, "Path to the policy file.")
+        ->required();
+    verify->add_option("-j,--jobs", jobs, "Number of inputs checked at once.");
+    verify->add_option("--io", backend, backend_help)
+        ->transform(CLI::CheckedTransformer(backends, CLI::ignore_case));
 
-    File file;
-    bool loaded = file.load(input, writable);
+    std::string old_input;
+    std::string new_input;
+    std::vector<uint32_t> fail_on;
+    std::map<std::string, uint32_t> change_classes = {
+        {"added-dlls", (uint32_t)Change::AddedDll},
+        {"removed-dlls", (uint32_t)Change::RemovedDll},
+        {"order", (uint32_t)Change::Order},
+        {"added-symbols", (uint32_t)Change::AddedSymbol},
+        {"removed-symbols", (uint32_t)Change::RemovedSymbol},
+        {"added-exports", (uint32_t)Change::AddedExport},
+        {"removed-exports", (uint32_t)Change::RemovedExport},
+        {"added-images", (uint32_t)Change::AddedImage},
+        {"removed-images", (uint32_t)Change::RemovedImage},
+        {"any", UINT32_MAX},
+    };
+    CLI::App* diff = app.add_subcommand(
+        "diff",
+        "Compare the imports and exports of two builds of an image, or of "
+        "every image in two directories.");
+    diff->add_option("old", old_input, "Path to the old PE or directory.")
+        ->required();
+    diff->add_option("new", new_input, "Path to the new PE or directory.")
+        ->required();
+    diff->add_option("--fail-on",
+                     fail_on,
+                     "Comma-separated classes of change which exit with 1, "
+                     "or any. Without any, changes exit with 0.")
+        ->delimiter(',')
+        ->transform(CLI::CheckedTransformer(change_classes, CLI::ignore_case));
+    diff->add_option(
+        "-j,--jobs", jobs, "Number of image pairs compared at once.");
+    diff->add_option("--io", backend, backend_help)
+        ->transform(CLI::CheckedTransformer(backends, CLI::ignore_case));
+
+    app.require_subcommand();
 
-    if (!loaded)
+    CLI11_PARSE(app, argc, argv);
+
+    ApiSet schema;
+    if (!apiset_path.empty())
     {
-        return 1;
+        std::string error;
+        if (!schema.load(apiset_path, error))
+        {
+            std::fprintf(stderr,
+                         "Invalid API Set schema %s: %s\n",
+                         apiset_path.c_str(),
+                         error.c_str());
+            return 1;
+        }
+        apiset = &schema;
     }
 
-    PE pe;
-    if (!pe.load(file.data(), writable))
+    // Policies are compiled once, then shared by every input
+    Policy policy;
+    if (!policy_path.empty())
     {
-        std::fprintf(stderr, "Input file is not a valid PE executable.");
-        return 1;
+        std::string error;
+        if (!policy.load(policy_path, error))
+        {
+            std::fprintf(stderr,
+                         "Invalid policy %s: %s\n",
+                         policy_path.c_str(),
+                         error.c_str());
+            return 1;
+        }
     }
 
     if (*list)
     {
-        pe.examine_imports();
+        return list_imports(input, backend);
     }
     else if (*escalate)
     {
-        if (dry_run)
+        if (policy_path.empty())
         {
-            pe.escalate(dlls, nullptr);
+            return escalate_imports(input, dlls, dry_run, backend);
         }
-        else
+
+        inputs = {input};
+        inputs.insert(inputs.end(), dlls.begin(), dlls.end());
+        return escalate_policy(policy, inputs, dry_run, backend);
+    }
+    else if (*compact)
+    {
+        return compact_imports(input, dry_run, backend);
+    }
+    else if (*verify)
+    {
+        std::vector<std::string> paths;
+        if (!expand_inputs(inputs, paths))
+        {
+            return 1;
+        }
+        return verify_policy(policy, paths, jobs, backend);
+    }
+    else if (*add)
+    {
+        return add_import(input, dll, symbol, position, dry_run, backend);
+    }
+    else if (*diff)
+    {
+        uint32_t mask = 0;
+        for (uint32_t change : fail_on)
         {
-            pe.escalate(dlls, file.mutable_data());
+            mask |= change;
         }
+        return diff_inputs(old_input, new_input, mask, jobs, backend);
     }
 
     return 0;
@@ -0,0 +1,90 @@
+#include <peachy.h>
+
+#include <PE.hpp>
+#include <new>
+
+static_assert(sizeof(PE) <= sizeof(peachy_image::storage),
+              "peachy_image storage is too small to hold a PE");
+static_assert(alignof(PE) <= alignof(peachy_image),
+              "peachy_image storage is insufficiently aligned for a PE");
+
+static_assert((int)Status::Ok == PEACHY_OK);
+static_assert((int)Status::InvalidImage == PEACHY_INVALID_IMAGE);
+static_assert((int)Status::Truncated == PEACHY_TRUNCATED);
+static_assert((int)Status::InvalidImports == PEACHY_INVALID_IMPORTS);
+static_assert((int)Status::DuplicateDll == PEACHY_DUPLICATE_DLL);
+static_assert((int)Status::MissingDll == PEACHY_MISSING_DLL);
+static_assert((int)Status::ReadOnly == PEACHY_READ_ONLY);
+static_assert((int)Status::IOError == PEACHY_IO_ERROR);
+static_assert((int)Status::NoSpace == PEACHY_NO_SPACE);
+static_assert((int)Status::PolicyViolation == PEACHY_POLICY_VIOLATION);
+static_assert((int)Status::InvalidExports == PEACHY_INVALID_EXPORTS);
+
+// PE holds no resources, so constructing one in place over the storage is all
+// that's needed, and it never has to be destroyed.
+static PE* pe(peachy_image* image)
+{
+    return std::launder(reinterpret_cast<PE*>(image->storage));
+}
+
+static PE const* pe(peachy_image const* image)
+{
+    return std::launder(reinterpret_cast<PE const*>(image->storage));
+}
+
+char const* peachy_describe(peachy_status status)
+{
+    return describe((Status)status);
+}
+
+peachy_status peachy_parse(peachy_image* image, void const* data, size_t size)
+{
+    PE* result = new (image->storage) PE{};
+    return (peachy_status)result->load((char const*)data, size);
+}
+
+peachy_status peachy_parse_mutable(peachy_image* image, void* data, size_t size)
+{
+    PE* result = new (image->storage) PE{};
+    return (peachy_status)result->load((char*)data, size);
+}
+
+uint32_t peachy_import_count(peachy_image const* image)
+{
+    return pe(image)->import_count();
+}
+
+peachy_status peachy_import_at(peachy_image* image,
+                               uint32_t index,
+                               peachy_import* import)
+{
+    Import result;
+    Status status = pe(image)->import_at(index, result);
+    if (status != Status::Ok)
+    {
+        return (peachy_status)status;
+    }
+
+    import->name             = result.name;
+    import->lookup_table_rva = result.entry.lookup_table_rva;
+    import->time_date_stamp  = result.entry.time_date_stamp;
+    import->forward_chain    = result.entry.forward_chain;
+    import->name_rva         = result.entry.name_rva;
+    import->iat_rva          = result.entry.iat_rva;
+    return PEACHY_OK;
+}
+
+peachy_status peachy_plan_escalation(peachy_image* image,
+                                     char const* const* dlls,
+                                     uint32_t dll_count,
+                                     uint32_t* order,
+                                     uint32_t* failed_dll)
+{
+    return (peachy_status)pe(image)->plan_escalation(
+        dlls, dll_count, order, failed_dll);
+}
+
+peachy_status peachy_reorder_imports(peachy_image* image, uint32_t const* order)
+{
+    return (peachy_status)pe(image)->reorder_imports(order);
+}
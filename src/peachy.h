@@ -0,0 +1,83 @@
+#pragma once
+
+// C interface to libpeachy, for parsing and reordering the imports of PE
+// images already held in memory. No function allocates: images live in
+// caller-provided storage and results are written to caller-provided arrays.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum peachy_status
+    {
+        PEACHY_OK = 0,
+        PEACHY_INVALID_IMAGE,
+        PEACHY_TRUNCATED,
+        PEACHY_INVALID_IMPORTS,
+        PEACHY_DUPLICATE_DLL,
+        PEACHY_MISSING_DLL,
+        PEACHY_READ_ONLY,
+        PEACHY_IO_ERROR,
+        PEACHY_NO_SPACE,
+        PEACHY_POLICY_VIOLATION,
+        PEACHY_INVALID_EXPORTS,
+    } peachy_status;
+
+    // Opaque storage for a parsed image. It may live on the stack, and holds
+    // pointers into the buffer it was parsed from.
+    typedef struct peachy_image
+    {
+        uint64_t storage[64];
+    } peachy_image;
+
+    typedef struct peachy_import
+    {
+        // Points into the image buffer
+        char const* name;
+        uint32_t lookup_table_rva;
+        uint32_t time_date_stamp;
+        uint32_t forward_chain;
+        uint32_t name_rva;
+        uint32_t iat_rva;
+    } peachy_import;
+
+    char const* peachy_describe(peachy_status status);
+
+    // Parse the image in `data`, which must outlive `image`. Images parsed
+    // with peachy_parse are read-only.
+    peachy_status peachy_parse(peachy_image* image,
+                               void const* data,
+                               size_t size);
+    peachy_status peachy_parse_mutable(peachy_image* image,
+                                       void* data,
+                                       size_t size);
+
+    // Number of DLLs imported, in load order
+    uint32_t peachy_import_count(peachy_image const* image);
+
+    peachy_status peachy_import_at(peachy_image* image,
+                                   uint32_t index,
+                                   peachy_import* import);
+
+    // Compute the load order with `dlls` escalated to the front, matching
+    // names case-insensitively. `order` must hold peachy_import_count
+    // entries, and receives the original index of each import in its new
+    // position. On PEACHY_DUPLICATE_DLL or PEACHY_MISSING_DLL, `failed_dll`
+    // (if not null) receives the index of the offending entry in `dlls`.
+    peachy_status peachy_plan_escalation(peachy_image* image,
+                                         char const* const* dlls,
+                                         uint32_t dll_count,
+                                         uint32_t* order,
+                                         uint32_t* failed_dll);
+
+    // Rewrite the import directory of a mutable image in the given order.
+    peachy_status peachy_reorder_imports(peachy_image* image,
+                                         uint32_t const* order);
+
+#ifdef __cplusplus
+}
+#endif